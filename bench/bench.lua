@@ -0,0 +1,236 @@
+-- throughput benchmarks for the miniflac bindings
+--
+-- usage: lua bench/bench.lua [-t seconds] [-o file] fixture.flac ...
+--
+-- each benchmark is repeated for at least the given CPU time (default 1
+-- second) on every fixture, and the results are written as JSON to the
+-- file, or printed. run it with the module paths set, `make bench` does
+-- this for you.
+
+local miniflac = require'miniflac'
+local decoder = require'miniflac.decoder'
+
+local clock = os.clock
+local format = string.format
+local concat = table.concat
+local insert = table.insert
+local sort = table.sort
+local type = type
+local pairs = pairs
+local ipairs = ipairs
+local tostring = tostring
+local tonumber = tonumber
+
+local NATIVE = miniflac.MINIFLAC_CONTAINER_NATIVE
+local CHUNK = 4096
+
+local function json_string(s)
+  return '"' .. s:gsub('[%c"\\]',function(c)
+    if c == '"' then return '\\"' end
+    if c == '\\' then return '\\\\' end
+    return format('\\u%04x',c:byte())
+  end) .. '"'
+end
+
+local function json(v)
+  local t = type(v)
+  local keys, out
+
+  if v == nil then return 'null' end
+  if t == 'boolean' then return tostring(v) end
+  if t == 'number' then
+    if v ~= v or v == math.huge or v == -math.huge then return 'null' end
+    if v == math.floor(v) and v < 2^53 and v > -2^53 then
+      return format('%d',v)
+    end
+    return format('%.6g',v)
+  end
+  if t == 'string' then return json_string(v) end
+
+  out = {}
+  if #v > 0 then
+    for _,x in ipairs(v) do insert(out,json(x)) end
+    return '[' .. concat(out,',') .. ']'
+  end
+  keys = {}
+  for k in pairs(v) do insert(keys,k) end
+  sort(keys)
+  for _,k in ipairs(keys) do
+    insert(out,json_string(k) .. ':' .. json(v[k]))
+  end
+  return '{' .. concat(out,',') .. '}'
+end
+
+local function check(err,what)
+  if err then error(format('%s: %s',what,tostring(err))) end
+end
+
+-- the benchmarks, each takes the file contents and the
+-- offset of the first frame, and returns how many bytes it processed
+
+local benches = {}
+
+benches[#benches+1] = { 'metadata', function(data,audio_offset)
+  decoder.scan_metadata(data,NATIVE)
+  return audio_offset
+end, false }
+
+benches[#benches+1] = { 'sync', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local pos, result, err = 1
+  repeat
+    result, err, pos = dec:sync_at(data,pos)
+    check(err,'sync')
+  until not result
+  return #data
+end, true }
+
+benches[#benches+1] = { 'decode_samples', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local pos, result, err = 1
+  repeat
+    result, err, pos = dec:sync_at(data,pos)
+    check(err,'sync')
+    if result and result.type == 'frame' then
+      result, err, pos = dec:decode_at(data,pos)
+      check(err,'decode')
+    end
+  until not result
+  return #data
+end, true }
+
+benches[#benches+1] = { 'decode_pcm', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local pos, result, err = 1
+  repeat
+    result, err, pos = dec:sync_at(data,pos)
+    check(err,'sync')
+    if result and result.type == 'frame' then
+      result, err, pos = dec:decode_pcm_at(data,pos,'s16')
+      check(err,'decode_pcm')
+    end
+  until not result
+  return #data
+end, true }
+
+benches[#benches+1] = { 'decode_many', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local pos, result, err = 1
+  repeat
+    result, err, pos = dec:sync_at(data,pos)
+    check(err,'sync')
+    if result and result.type == 'frame' then
+      result, err, pos = dec:decode_many_at(data,pos,{ samples = 65536 },'s16')
+      check(err,'decode_many')
+    end
+  until not result
+  return #data
+end, true }
+
+benches[#benches+1] = { 'decoder', function(data)
+  local decode = decoder.new(NATIVE)
+  local pos = 1
+  while pos <= #data do
+    decode(data:sub(pos,pos + CHUNK - 1))
+    pos = pos + CHUNK
+  end
+  decode(nil)
+  return #data
+end, true }
+
+-- runs f until min_time has passed, returns the
+-- iterations, elapsed time and bytes per iteration
+local function measure(f,min_time,...)
+  local iterations = 0
+  local bytes = 0
+  local start = clock()
+  local elapsed = 0
+
+  repeat
+    bytes = f(...)
+    iterations = iterations + 1
+    elapsed = clock() - start
+  until elapsed >= min_time
+
+  return iterations, elapsed, bytes
+end
+
+local function load_fixture(path)
+  local f = assert(io.open(path,'rb'))
+  local data = f:read('*a')
+  local audio_offset = 4
+  local fixture = { path = path, size = #data, data = data }
+  f:close()
+
+  for _,b in ipairs(decoder.scan_metadata(data,NATIVE)) do
+    audio_offset = audio_offset + 4 + b.metadata.length
+    if b.metadata.type == 'streaminfo' then
+      local si = b.metadata.streaminfo
+      fixture.block_size = si.max_block_size
+      fixture.channels = si.channels
+      fixture.bps = si.bps
+      fixture.sample_rate = si.sample_rate
+      fixture.samples = tonumber(tostring(si.total_samples))
+    end
+  end
+  fixture.audio_offset = audio_offset
+
+  return fixture
+end
+
+local min_time = 1
+local out_path
+local paths = {}
+local i = 1
+while arg[i] do
+  if arg[i] == '-t' then
+    i = i + 1
+    min_time = assert(tonumber(arg[i]),'-t needs a number of seconds')
+  elseif arg[i] == '-o' then
+    i = i + 1
+    out_path = assert(arg[i],'-o needs a file name')
+  else
+    insert(paths,arg[i])
+  end
+  i = i + 1
+end
+
+if #paths == 0 then
+  io.stderr:write('usage: lua bench/bench.lua [-t seconds] [-o file] fixture.flac ...\n')
+  os.exit(1)
+end
+
+local results = {}
+
+for _,path in ipairs(paths) do
+  local fixture = load_fixture(path)
+
+  for _,b in ipairs(benches) do
+    local name, f, audio = b[1], b[2], b[3]
+    local iterations, elapsed, bytes = measure(f,min_time,fixture.data,fixture.audio_offset)
+
+    insert(results,{
+      fixture = fixture.path,
+      bench = name,
+      block_size = fixture.block_size,
+      channels = fixture.channels,
+      bps = fixture.bps,
+      sample_rate = fixture.sample_rate,
+      bytes = bytes,
+      iterations = iterations,
+      seconds = elapsed,
+      mb_per_sec = bytes * iterations / elapsed / 1e6,
+      samples_per_sec = audio and fixture.samples * iterations / elapsed or nil,
+    })
+  end
+end
+
+local out = out_path and assert(io.open(out_path,'wb')) or io.stdout
+out:write(json({
+  lua = _VERSION,
+  miniflac = miniflac._VERSION,
+  simd = miniflac._SIMD,
+  min_time = min_time,
+  results = results,
+}),'\n')
+if out ~= io.stdout then out:close() end
@@ -0,0 +1,321 @@
+/* writes a synthetic FLAC file for benchmarking
+ *
+ * usage: gen_fixture out.flac block_size channels bps seconds [sample_rate]
+ *
+ * the audio is a sine per channel with a little noise, encoded with a
+ * FIXED order 2 predictor and Rice-coded residuals, which is close to
+ * what real encoders produce for tonal material. no MD5 is stored. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define PI 3.14159265358979323846
+
+typedef struct bitwriter_s {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    uint64_t acc;
+    unsigned int bits;
+} bitwriter_t;
+
+static void
+bw_byte(bitwriter_t* bw, uint8_t b) {
+    if(bw->len == bw->cap) {
+        bw->cap = bw->cap ? bw->cap * 2 : 65536;
+        bw->data = realloc(bw->data,bw->cap);
+        if(bw->data == NULL) {
+            fprintf(stderr,"out of memory\n");
+            exit(1);
+        }
+    }
+    bw->data[bw->len++] = b;
+}
+
+static void
+bw_write(bitwriter_t* bw, uint32_t val, unsigned int bits) {
+    if(bits == 0) return;
+    if(bits < 32) val &= (1U << bits) - 1;
+    bw->acc = (bw->acc << bits) | val;
+    bw->bits += bits;
+    while(bw->bits >= 8) {
+        bw->bits -= 8;
+        bw_byte(bw,(uint8_t)(bw->acc >> bw->bits));
+    }
+}
+
+static void
+bw_align(bitwriter_t* bw) {
+    if(bw->bits) bw_write(bw,0,8 - bw->bits);
+}
+
+static void
+bw_unary(bitwriter_t* bw, uint32_t zeros) {
+    while(zeros >= 32) {
+        bw_write(bw,0,32);
+        zeros -= 32;
+    }
+    bw_write(bw,1,zeros + 1);
+}
+
+static uint8_t
+crc8(const uint8_t* data, size_t len) {
+    uint8_t crc = 0;
+    size_t i = 0;
+    unsigned int b = 0;
+
+    for(i=0;i<len;i++) {
+        crc ^= data[i];
+        for(b=0;b<8;b++) {
+            crc = (uint8_t)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint16_t
+crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0;
+    size_t i = 0;
+    unsigned int b = 0;
+
+    for(i=0;i<len;i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+        for(b=0;b<8;b++) {
+            crc = (uint16_t)(crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+/* frame numbers use the UTF-8 style variable length coding */
+static void
+write_utf8(bitwriter_t* bw, uint32_t val) {
+    unsigned int n = 0;
+    unsigned int i = 0;
+
+    if(val < 0x80) {
+        bw_write(bw,val,8);
+        return;
+    }
+    if(val < 0x800) n = 2;
+    else if(val < 0x10000) n = 3;
+    else if(val < 0x200000) n = 4;
+    else if(val < 0x4000000) n = 5;
+    else n = 6;
+
+    bw_write(bw,((1U << n) - 1) << 1,n + 1);
+    bw_write(bw,val >> (6 * (n - 1)),7 - n);
+    for(i=n-1;i>0;i--) {
+        bw_write(bw,0x80 | ((val >> (6 * (i - 1))) & 0x3F),8);
+    }
+}
+
+static void
+write_residual(bitwriter_t* bw, const int32_t* residual, uint32_t len) {
+    uint64_t sum = 0;
+    uint32_t i = 0;
+    uint32_t u = 0;
+    unsigned int k = 0;
+
+    for(i=0;i<len;i++) {
+        sum += (uint32_t)(residual[i] < 0 ? -residual[i] : residual[i]);
+    }
+    /* the parameter where 2^k is about the mean magnitude */
+    while(k < 14 && ((uint64_t)len << (k + 1)) < sum) k++;
+
+    bw_write(bw,0,2); /* 4-bit Rice parameters */
+    bw_write(bw,0,4); /* one partition */
+    bw_write(bw,k,4);
+    for(i=0;i<len;i++) {
+        u = residual[i] < 0 ? ((uint32_t)(-residual[i]) << 1) - 1 : (uint32_t)residual[i] << 1;
+        bw_unary(bw,u >> k);
+        bw_write(bw,u,k);
+    }
+}
+
+static void
+write_subframe(bitwriter_t* bw, const int32_t* samples, uint32_t len, unsigned int bps, int32_t* residual) {
+    uint32_t i = 0;
+    unsigned int order = len > 2 ? 2 : 0;
+
+    bw_write(bw,0,1);
+    bw_write(bw,0x08 | order,6); /* FIXED */
+    bw_write(bw,0,1);            /* no wasted bits */
+    for(i=0;i<order;i++) {
+        bw_write(bw,(uint32_t)samples[i],bps);
+    }
+    for(i=order;i<len;i++) {
+        residual[i - order] = order == 2 ? samples[i] - 2 * samples[i-1] + samples[i-2] : samples[i];
+    }
+    write_residual(bw,residual,len - order);
+}
+
+static unsigned int
+bps_code(unsigned int bps) {
+    switch(bps) {
+        case 8: return 1;
+        case 12: return 2;
+        case 16: return 4;
+        case 20: return 5;
+        case 24: return 6;
+        default: break;
+    }
+    return 0;
+}
+
+static void
+write_frame(bitwriter_t* bw, int32_t** samples, uint32_t len, unsigned int channels, unsigned int bps, uint32_t number, int32_t* residual) {
+    size_t start = bw->len;
+    unsigned int c = 0;
+    uint16_t crc = 0;
+
+    bw_write(bw,0x3FFE,14);
+    bw_write(bw,0,1);
+    bw_write(bw,0,1); /* fixed block size */
+    bw_write(bw,7,4); /* 16-bit block size at the end of the header */
+    bw_write(bw,0,4); /* sample rate from STREAMINFO */
+    bw_write(bw,channels - 1,4);
+    bw_write(bw,bps_code(bps),3);
+    bw_write(bw,0,1);
+    write_utf8(bw,number);
+    bw_write(bw,len - 1,16);
+    bw_write(bw,crc8(&bw->data[start],bw->len - start),8);
+
+    for(c=0;c<channels;c++) {
+        write_subframe(bw,samples[c],len,bps,residual);
+    }
+    bw_align(bw);
+
+    crc = crc16(&bw->data[start],bw->len - start);
+    bw_write(bw,crc,16);
+}
+
+static void
+write_metadata(bitwriter_t* bw, uint32_t block_size, uint32_t sample_rate, unsigned int channels, unsigned int bps, uint64_t total) {
+    static const char vendor[] = "luaminiflac bench";
+    char comment[64];
+    unsigned int i = 0;
+    size_t j = 0;
+    size_t len = 0;
+    uint32_t comments_len = 0;
+
+    for(j=0;j<4;j++) bw_byte(bw,(uint8_t)"fLaC"[j]);
+
+    /* STREAMINFO */
+    bw_write(bw,0,1);
+    bw_write(bw,0,7);
+    bw_write(bw,34,24);
+    bw_write(bw,block_size,16);
+    bw_write(bw,block_size,16);
+    bw_write(bw,0,24);
+    bw_write(bw,0,24);
+    bw_write(bw,sample_rate,20);
+    bw_write(bw,channels - 1,3);
+    bw_write(bw,bps - 1,5);
+    bw_write(bw,(uint32_t)(total >> 32),4);
+    bw_write(bw,(uint32_t)total,32);
+    for(j=0;j<16;j++) bw_write(bw,0,8);
+
+    /* a VORBIS_COMMENT block with enough tags to time parsing */
+    comments_len = 4 + sizeof(vendor) - 1 + 4;
+    for(i=0;i<32;i++) {
+        comments_len += 4 + (uint32_t)sprintf(comment,"COMMENT%02u=benchmark tag number %u",i,i);
+    }
+    bw_write(bw,0,1);
+    bw_write(bw,4,7);
+    bw_write(bw,comments_len,24);
+    len = sizeof(vendor) - 1;
+    for(j=0;j<4;j++) bw_byte(bw,(uint8_t)(len >> (8 * j)));
+    for(j=0;j<len;j++) bw_byte(bw,(uint8_t)vendor[j]);
+    for(j=0;j<4;j++) bw_byte(bw,(uint8_t)(32 >> (8 * j)));
+    for(i=0;i<32;i++) {
+        len = (size_t)sprintf(comment,"COMMENT%02u=benchmark tag number %u",i,i);
+        for(j=0;j<4;j++) bw_byte(bw,(uint8_t)(len >> (8 * j)));
+        for(j=0;j<len;j++) bw_byte(bw,(uint8_t)comment[j]);
+    }
+
+    /* PADDING, last block */
+    bw_write(bw,1,1);
+    bw_write(bw,1,7);
+    bw_write(bw,1024,24);
+    for(j=0;j<1024;j++) bw_byte(bw,0);
+}
+
+int main(int argc, char* argv[]) {
+    bitwriter_t bw;
+    FILE* f = NULL;
+    int32_t* samples[8];
+    int32_t* residual = NULL;
+    uint32_t block_size = 0;
+    unsigned int channels = 0;
+    unsigned int bps = 0;
+    double seconds = 0;
+    uint32_t sample_rate = 44100;
+    uint64_t total = 0;
+    uint64_t pos = 0;
+    uint32_t len = 0;
+    uint32_t number = 0;
+    uint32_t seed = 12345;
+    uint32_t i = 0;
+    unsigned int c = 0;
+    double amp = 0;
+    double v = 0;
+
+    if(argc < 6) {
+        fprintf(stderr,"usage: %s out.flac block_size channels bps seconds [sample_rate]\n",argv[0]);
+        return 1;
+    }
+
+    block_size = (uint32_t)strtoul(argv[2],NULL,10);
+    channels = (unsigned int)strtoul(argv[3],NULL,10);
+    bps = (unsigned int)strtoul(argv[4],NULL,10);
+    seconds = strtod(argv[5],NULL);
+    if(argc > 6) sample_rate = (uint32_t)strtoul(argv[6],NULL,10);
+
+    if(block_size < 16 || block_size > 65535 || channels < 1 || channels > 8
+      || bps_code(bps) == 0 || seconds <= 0 || sample_rate == 0 || sample_rate > 655350) {
+        fprintf(stderr,"%s: invalid parameters\n",argv[0]);
+        return 1;
+    }
+
+    total = (uint64_t)(seconds * sample_rate);
+    memset(&bw,0,sizeof(bw));
+    for(c=0;c<channels;c++) {
+        samples[c] = malloc(sizeof(int32_t) * block_size);
+        if(samples[c] == NULL) return 1;
+    }
+    residual = malloc(sizeof(int32_t) * block_size);
+    if(residual == NULL) return 1;
+
+    write_metadata(&bw,block_size,sample_rate,channels,bps,total);
+
+    amp = (double)((1 << (bps - 1)) - 1) * 0.5;
+    for(pos=0;pos<total;pos+=len) {
+        len = total - pos < block_size ? (uint32_t)(total - pos) : block_size;
+        for(c=0;c<channels;c++) {
+            for(i=0;i<len;i++) {
+                seed = seed * 1103515245 + 12345;
+                v = amp * sin(2.0 * PI * 220.0 * (c + 1) * (double)(pos + i) / sample_rate);
+                v += amp * 0.01 * ((double)(seed >> 16 & 0x7FFF) / 16384.0 - 1.0);
+                samples[c][i] = (int32_t)floor(v + 0.5);
+            }
+        }
+        write_frame(&bw,samples,len,channels,bps,number++,residual);
+    }
+
+    f = fopen(argv[1],"wb");
+    if(f == NULL || fwrite(bw.data,1,bw.len,f) != bw.len) {
+        fprintf(stderr,"%s: unable to write %s\n",argv[0],argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    for(c=0;c<channels;c++) free(samples[c]);
+    free(residual);
+    free(bw.data);
+    return 0;
+}
@@ -0,0 +1,528 @@
+/* PCM packing for luaminiflac: planar int32_t samples to interleaved,
+ * little-endian s16/s24/s32/f32, with vector kernels for mono and
+ * stereo. included by miniflac.c, and by test/pack_pcm.c to check the
+ * kernels against the scalar code */
+
+#ifndef LUAMINIFLAC_PCM_H
+#define LUAMINIFLAC_PCM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* vector kernels for packing PCM, define LUAMINIFLAC_NO_SIMD to only
+ * build the scalar code. SSE2 is part of x86-64, AVX2 is picked at
+ * runtime on gcc and clang. the NEON kernels haven't been run against
+ * the scalar code on an AArch64 machine yet, so they're only built with
+ * LUAMINIFLAC_ENABLE_NEON */
+#ifndef LUAMINIFLAC_NO_SIMD
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) \
+  || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUAMINIFLAC_SSE2 1
+#include <emmintrin.h>
+#if (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#define LUAMINIFLAC_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+#if defined(LUAMINIFLAC_ENABLE_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+#define LUAMINIFLAC_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+/* output formats for decode_pcm, in luaminiflac_pcm_formats order */
+typedef enum LUAMINIFLAC_PCM {
+    LUAMINIFLAC_PCM_S16 = 0,
+    LUAMINIFLAC_PCM_S24 = 1,
+    LUAMINIFLAC_PCM_S32 = 2,
+    LUAMINIFLAC_PCM_F32 = 3,
+} LUAMINIFLAC_PCM;
+
+/* packs planar samples into interleaved, little-endian PCM, starting
+ * at sample first. this is the reference the vector kernels match, and
+ * finishes off whatever doesn't fill a whole vector */
+static void
+luaminiflac_pack_pcm_scalar(uint8_t* out, int32_t** samples, uint8_t channels, uint32_t first, uint32_t block_size, uint8_t bps, LUAMINIFLAC_PCM format) {
+    uint8_t channel = 0;
+    uint32_t sample = 0;
+    uint32_t u = 0;
+    int32_t s = 0;
+    float f = 0.0f;
+    float scale = 1.0f;
+
+    scale = 1.0f / (float)(1ULL << (bps - 1));
+
+    for(sample=first;sample<block_size;sample++) {
+        for(channel=0;channel<channels;channel++) {
+            s = samples[channel][sample];
+            switch(format) {
+                case LUAMINIFLAC_PCM_S16: {
+                    s = bps > 16 ? s >> (bps - 16) : (int32_t)((uint32_t)s << (16 - bps));
+                    out[0] = (uint8_t)s;
+                    out[1] = (uint8_t)(s >> 8);
+                    out += 2;
+                    break;
+                }
+                case LUAMINIFLAC_PCM_S24: {
+                    s = bps > 24 ? s >> (bps - 24) : (int32_t)((uint32_t)s << (24 - bps));
+                    out[0] = (uint8_t)s;
+                    out[1] = (uint8_t)(s >> 8);
+                    out[2] = (uint8_t)(s >> 16);
+                    out += 3;
+                    break;
+                }
+                case LUAMINIFLAC_PCM_S32: {
+                    u = (uint32_t)s << (32 - bps);
+                    out[0] = (uint8_t)u;
+                    out[1] = (uint8_t)(u >> 8);
+                    out[2] = (uint8_t)(u >> 16);
+                    out[3] = (uint8_t)(u >> 24);
+                    out += 4;
+                    break;
+                }
+                case LUAMINIFLAC_PCM_F32: {
+                    f = (float)s * scale;
+                    memcpy(&u,&f,sizeof(u));
+                    out[0] = (uint8_t)u;
+                    out[1] = (uint8_t)(u >> 8);
+                    out[2] = (uint8_t)(u >> 16);
+                    out[3] = (uint8_t)(u >> 24);
+                    out += 4;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+/* a kernel packs a whole frame of one or two channels, given a bps
+ * from 1 to 32 */
+typedef void (*luaminiflac_pack_func)(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps);
+
+/* kernel sets, in luaminiflac_simd_names order */
+typedef enum LUAMINIFLAC_SIMD {
+    LUAMINIFLAC_SIMD_SCALAR = 0,
+    LUAMINIFLAC_SIMD_SSE2 = 1,
+    LUAMINIFLAC_SIMD_AVX2 = 2,
+    LUAMINIFLAC_SIMD_NEON = 3,
+} LUAMINIFLAC_SIMD;
+
+static const char* const luaminiflac_simd_names[] = {
+    "scalar",
+    "sse2",
+    "avx2",
+    "neon",
+    NULL,
+};
+
+/* [format][channels - 1], NULL entries use the scalar code */
+static luaminiflac_pack_func luaminiflac_pack_kernels[4][2];
+static const char* luaminiflac_simd = "scalar";
+
+#ifdef LUAMINIFLAC_SSE2
+/* the shifts are done on whole vectors, only one of them is non-zero */
+#define LUAMINIFLAC_SHIFTS(bits) \
+    __m128i lshift = _mm_cvtsi32_si128(bps < (bits) ? (bits) - bps : 0); \
+    __m128i rshift = _mm_cvtsi32_si128(bps > (bits) ? bps - (bits) : 0)
+
+/* shifts to 16 bits and keeps the low 16 bits sign-extended, so the
+ * saturating pack can't change anything and it matches the scalar
+ * code even for samples outside of bps */
+static inline __m128i
+luaminiflac_sse2_s16(__m128i v, __m128i lshift, __m128i rshift) {
+    v = _mm_sra_epi32(_mm_sll_epi32(v,lshift),rshift);
+    return _mm_srai_epi32(_mm_slli_epi32(v,16),16);
+}
+
+static void
+luaminiflac_sse2_s16_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    __m128i a, b;
+    LUAMINIFLAC_SHIFTS(16);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        a = luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&m[i]),lshift,rshift);
+        b = luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&m[i+4]),lshift,rshift);
+        _mm_storeu_si128((__m128i*)&out[i * 2],_mm_packs_epi32(a,b));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 2],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+static void
+luaminiflac_sse2_s16_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m128i lv, rv;
+    LUAMINIFLAC_SHIFTS(16);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        lv = _mm_packs_epi32(
+          luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&l[i]),lshift,rshift),
+          luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&l[i+4]),lshift,rshift));
+        rv = _mm_packs_epi32(
+          luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&r[i]),lshift,rshift),
+          luaminiflac_sse2_s16(_mm_loadu_si128((const __m128i*)&r[i+4]),lshift,rshift));
+        _mm_storeu_si128((__m128i*)&out[i * 4],_mm_unpacklo_epi16(lv,rv));
+        _mm_storeu_si128((__m128i*)&out[i * 4 + 16],_mm_unpackhi_epi16(lv,rv));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 4],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+static void
+luaminiflac_sse2_s32_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    __m128i shift = _mm_cvtsi32_si128(32 - bps);
+
+    for(i=0;i+4<=block_size;i+=4) {
+        _mm_storeu_si128((__m128i*)&out[i * 4],
+          _mm_sll_epi32(_mm_loadu_si128((const __m128i*)&m[i]),shift));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 4],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_S32);
+}
+
+static void
+luaminiflac_sse2_s32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m128i lv, rv;
+    __m128i shift = _mm_cvtsi32_si128(32 - bps);
+
+    for(i=0;i+4<=block_size;i+=4) {
+        lv = _mm_sll_epi32(_mm_loadu_si128((const __m128i*)&l[i]),shift);
+        rv = _mm_sll_epi32(_mm_loadu_si128((const __m128i*)&r[i]),shift);
+        _mm_storeu_si128((__m128i*)&out[i * 8],_mm_unpacklo_epi32(lv,rv));
+        _mm_storeu_si128((__m128i*)&out[i * 8 + 16],_mm_unpackhi_epi32(lv,rv));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S32);
+}
+
+/* int to float conversion rounds to nearest either way, and the scale
+ * is a power of two, so this is exact against the scalar code */
+static void
+luaminiflac_sse2_f32_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    __m128 scale = _mm_set1_ps(1.0f / (float)(1ULL << (bps - 1)));
+
+    for(i=0;i+4<=block_size;i+=4) {
+        _mm_storeu_ps((float*)&out[i * 4],
+          _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&m[i])),scale));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 4],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_F32);
+}
+
+static void
+luaminiflac_sse2_f32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m128 lv, rv;
+    __m128 scale = _mm_set1_ps(1.0f / (float)(1ULL << (bps - 1)));
+
+    for(i=0;i+4<=block_size;i+=4) {
+        lv = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&l[i])),scale);
+        rv = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&r[i])),scale);
+        _mm_storeu_ps((float*)&out[i * 8],_mm_unpacklo_ps(lv,rv));
+        _mm_storeu_ps((float*)&out[i * 8 + 16],_mm_unpackhi_ps(lv,rv));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_F32);
+}
+#endif
+
+#ifdef LUAMINIFLAC_AVX2
+#define LUAMINIFLAC_AVX2_FUNC __attribute__((target("avx2")))
+
+LUAMINIFLAC_AVX2_FUNC static inline __m256i
+luaminiflac_avx2_s16(__m256i v, __m128i lshift, __m128i rshift) {
+    v = _mm256_sra_epi32(_mm256_sll_epi32(v,lshift),rshift);
+    return _mm256_srai_epi32(_mm256_slli_epi32(v,16),16);
+}
+
+/* 16 samples shifted and packed to 16 bits, in order */
+LUAMINIFLAC_AVX2_FUNC static inline __m256i
+luaminiflac_avx2_load_s16(const int32_t* p, __m128i lshift, __m128i rshift) {
+    __m256i a = luaminiflac_avx2_s16(_mm256_loadu_si256((const __m256i*)p),lshift,rshift);
+    __m256i b = luaminiflac_avx2_s16(_mm256_loadu_si256((const __m256i*)&p[8]),lshift,rshift);
+    /* packs works within 128-bit lanes */
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),0xD8);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_s16_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    LUAMINIFLAC_SHIFTS(16);
+
+    for(i=0;i+16<=block_size;i+=16) {
+        _mm256_storeu_si256((__m256i*)&out[i * 2],luaminiflac_avx2_load_s16(&m[i],lshift,rshift));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 2],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_s16_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m256i lv, rv, lo, hi;
+    LUAMINIFLAC_SHIFTS(16);
+
+    for(i=0;i+16<=block_size;i+=16) {
+        lv = luaminiflac_avx2_load_s16(&l[i],lshift,rshift);
+        rv = luaminiflac_avx2_load_s16(&r[i],lshift,rshift);
+        lo = _mm256_unpacklo_epi16(lv,rv);
+        hi = _mm256_unpackhi_epi16(lv,rv);
+        _mm256_storeu_si256((__m256i*)&out[i * 4],_mm256_permute2x128_si256(lo,hi,0x20));
+        _mm256_storeu_si256((__m256i*)&out[i * 4 + 32],_mm256_permute2x128_si256(lo,hi,0x31));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 4],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+/* 24-bit output is every 4th byte dropped, done 128 bits at a time */
+LUAMINIFLAC_AVX2_FUNC static inline void
+luaminiflac_avx2_store_s24(uint8_t* out, __m128i v) {
+    const __m128i mask = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    uint8_t tmp[16];
+
+    _mm_storeu_si128((__m128i*)tmp,_mm_shuffle_epi8(v,mask));
+    memcpy(out,tmp,12);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_s24_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    __m256i v;
+    LUAMINIFLAC_SHIFTS(24);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        v = _mm256_sra_epi32(_mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)&m[i]),lshift),rshift);
+        luaminiflac_avx2_store_s24(&out[i * 3],_mm256_castsi256_si128(v));
+        luaminiflac_avx2_store_s24(&out[i * 3 + 12],_mm256_extracti128_si256(v,1));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 3],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_S24);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_s24_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m256i lv, rv, lo, hi;
+    LUAMINIFLAC_SHIFTS(24);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        lv = _mm256_sra_epi32(_mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)&l[i]),lshift),rshift);
+        rv = _mm256_sra_epi32(_mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)&r[i]),lshift),rshift);
+        /* lo is frames 0,1 | 4,5 and hi is 2,3 | 6,7 */
+        lo = _mm256_unpacklo_epi32(lv,rv);
+        hi = _mm256_unpackhi_epi32(lv,rv);
+        luaminiflac_avx2_store_s24(&out[i * 6],_mm256_castsi256_si128(lo));
+        luaminiflac_avx2_store_s24(&out[i * 6 + 12],_mm256_castsi256_si128(hi));
+        luaminiflac_avx2_store_s24(&out[i * 6 + 24],_mm256_extracti128_si256(lo,1));
+        luaminiflac_avx2_store_s24(&out[i * 6 + 36],_mm256_extracti128_si256(hi,1));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 6],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S24);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_s32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m256i lv, rv, lo, hi;
+    __m128i shift = _mm_cvtsi32_si128(32 - bps);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        lv = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)&l[i]),shift);
+        rv = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)&r[i]),shift);
+        lo = _mm256_unpacklo_epi32(lv,rv);
+        hi = _mm256_unpackhi_epi32(lv,rv);
+        _mm256_storeu_si256((__m256i*)&out[i * 8],_mm256_permute2x128_si256(lo,hi,0x20));
+        _mm256_storeu_si256((__m256i*)&out[i * 8 + 32],_mm256_permute2x128_si256(lo,hi,0x31));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S32);
+}
+
+LUAMINIFLAC_AVX2_FUNC static void
+luaminiflac_avx2_f32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    __m256 lv, rv, lo, hi;
+    __m256 scale = _mm256_set1_ps(1.0f / (float)(1ULL << (bps - 1)));
+
+    for(i=0;i+8<=block_size;i+=8) {
+        lv = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&l[i])),scale);
+        rv = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)&r[i])),scale);
+        lo = _mm256_unpacklo_ps(lv,rv);
+        hi = _mm256_unpackhi_ps(lv,rv);
+        _mm256_storeu_ps((float*)&out[i * 8],_mm256_permute2f128_ps(lo,hi,0x20));
+        _mm256_storeu_ps((float*)&out[i * 8 + 32],_mm256_permute2f128_ps(lo,hi,0x31));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_F32);
+}
+#endif
+
+#ifdef LUAMINIFLAC_NEON
+/* vst2 interleaves for us, and the narrowing keeps the low 16 bits
+ * the same way the scalar code does */
+static void
+luaminiflac_neon_s16_mono(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* m = samples[0];
+    uint32_t i = 0;
+    int32x4_t shift = vdupq_n_s32(16 - (int32_t)bps);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        vst1q_s16((int16_t*)&out[i * 2],vcombine_s16(
+          vmovn_s32(vshlq_s32(vld1q_s32(&m[i]),shift)),
+          vmovn_s32(vshlq_s32(vld1q_s32(&m[i+4]),shift))));
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 2],samples,1,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+static void
+luaminiflac_neon_s16_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    int16x8x2_t v;
+    int32x4_t shift = vdupq_n_s32(16 - (int32_t)bps);
+
+    for(i=0;i+8<=block_size;i+=8) {
+        v.val[0] = vcombine_s16(
+          vmovn_s32(vshlq_s32(vld1q_s32(&l[i]),shift)),
+          vmovn_s32(vshlq_s32(vld1q_s32(&l[i+4]),shift)));
+        v.val[1] = vcombine_s16(
+          vmovn_s32(vshlq_s32(vld1q_s32(&r[i]),shift)),
+          vmovn_s32(vshlq_s32(vld1q_s32(&r[i+4]),shift)));
+        vst2q_s16((int16_t*)&out[i * 4],v);
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 4],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S16);
+}
+
+static void
+luaminiflac_neon_s32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    int32x4x2_t v;
+    int32x4_t shift = vdupq_n_s32(32 - (int32_t)bps);
+
+    for(i=0;i+4<=block_size;i+=4) {
+        v.val[0] = vreinterpretq_s32_u32(vshlq_u32(vreinterpretq_u32_s32(vld1q_s32(&l[i])),shift));
+        v.val[1] = vreinterpretq_s32_u32(vshlq_u32(vreinterpretq_u32_s32(vld1q_s32(&r[i])),shift));
+        vst2q_s32((int32_t*)&out[i * 8],v);
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_S32);
+}
+
+static void
+luaminiflac_neon_f32_stereo(uint8_t* out, int32_t** samples, uint32_t block_size, uint8_t bps) {
+    const int32_t* l = samples[0];
+    const int32_t* r = samples[1];
+    uint32_t i = 0;
+    float32x4x2_t v;
+    float scale = 1.0f / (float)(1ULL << (bps - 1));
+
+    for(i=0;i+4<=block_size;i+=4) {
+        v.val[0] = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&l[i])),scale);
+        v.val[1] = vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&r[i])),scale);
+        vst2q_f32((float*)&out[i * 8],v);
+    }
+    luaminiflac_pack_pcm_scalar(&out[i * 8],samples,2,i,block_size,bps,LUAMINIFLAC_PCM_F32);
+}
+#endif
+
+/* fills k with one set of kernels, returns 0 when the set wasn't
+ * built or this CPU can't run it. avx2 keeps the sse2 kernels it has
+ * no replacement for */
+static int
+luaminiflac_pack_kernels_for(LUAMINIFLAC_SIMD set, luaminiflac_pack_func k[4][2]) {
+    memset(k,0,sizeof(luaminiflac_pack_func) * 4 * 2);
+    switch(set) {
+        case LUAMINIFLAC_SIMD_SCALAR: return 1;
+#ifdef LUAMINIFLAC_SSE2
+        case LUAMINIFLAC_SIMD_AVX2:
+#ifdef LUAMINIFLAC_AVX2
+            if(!__builtin_cpu_supports("avx2")) return 0;
+            k[LUAMINIFLAC_PCM_S16][0] = luaminiflac_avx2_s16_mono;
+            k[LUAMINIFLAC_PCM_S16][1] = luaminiflac_avx2_s16_stereo;
+            k[LUAMINIFLAC_PCM_S24][0] = luaminiflac_avx2_s24_mono;
+            k[LUAMINIFLAC_PCM_S24][1] = luaminiflac_avx2_s24_stereo;
+            k[LUAMINIFLAC_PCM_S32][0] = luaminiflac_sse2_s32_mono;
+            k[LUAMINIFLAC_PCM_S32][1] = luaminiflac_avx2_s32_stereo;
+            k[LUAMINIFLAC_PCM_F32][0] = luaminiflac_sse2_f32_mono;
+            k[LUAMINIFLAC_PCM_F32][1] = luaminiflac_avx2_f32_stereo;
+            return 1;
+#else
+            return 0;
+#endif
+        case LUAMINIFLAC_SIMD_SSE2:
+            k[LUAMINIFLAC_PCM_S16][0] = luaminiflac_sse2_s16_mono;
+            k[LUAMINIFLAC_PCM_S16][1] = luaminiflac_sse2_s16_stereo;
+            k[LUAMINIFLAC_PCM_S32][0] = luaminiflac_sse2_s32_mono;
+            k[LUAMINIFLAC_PCM_S32][1] = luaminiflac_sse2_s32_stereo;
+            k[LUAMINIFLAC_PCM_F32][0] = luaminiflac_sse2_f32_mono;
+            k[LUAMINIFLAC_PCM_F32][1] = luaminiflac_sse2_f32_stereo;
+            return 1;
+#endif
+#ifdef LUAMINIFLAC_NEON
+        case LUAMINIFLAC_SIMD_NEON:
+            k[LUAMINIFLAC_PCM_S16][0] = luaminiflac_neon_s16_mono;
+            k[LUAMINIFLAC_PCM_S16][1] = luaminiflac_neon_s16_stereo;
+            k[LUAMINIFLAC_PCM_S32][1] = luaminiflac_neon_s32_stereo;
+            k[LUAMINIFLAC_PCM_F32][1] = luaminiflac_neon_f32_stereo;
+            return 1;
+#endif
+        default: break;
+    }
+    return 0;
+}
+
+/* switches every pack to one set of kernels, returns 0 if it isn't
+ * available. only entries that change are written, so once a state
+ * has loaded the module, loading it again in another thread doesn't
+ * touch anything the first one reads */
+static int
+luaminiflac_pack_select(LUAMINIFLAC_SIMD set) {
+    luaminiflac_pack_func k[4][2];
+    unsigned int f = 0;
+    unsigned int c = 0;
+
+    if(!luaminiflac_pack_kernels_for(set,k)) return 0;
+    for(f=0;f<4;f++) {
+        for(c=0;c<2;c++) {
+            if(luaminiflac_pack_kernels[f][c] != k[f][c]) luaminiflac_pack_kernels[f][c] = k[f][c];
+        }
+    }
+    if(luaminiflac_simd != luaminiflac_simd_names[set]) luaminiflac_simd = luaminiflac_simd_names[set];
+    return 1;
+}
+
+/* picks the best kernels for this CPU, called from luaopen */
+static void
+luaminiflac_pack_init(void) {
+    if(luaminiflac_pack_select(LUAMINIFLAC_SIMD_AVX2)) return;
+    if(luaminiflac_pack_select(LUAMINIFLAC_SIMD_SSE2)) return;
+    if(luaminiflac_pack_select(LUAMINIFLAC_SIMD_NEON)) return;
+    luaminiflac_pack_select(LUAMINIFLAC_SIMD_SCALAR);
+}
+
+/* packs planar samples into interleaved, little-endian PCM */
+static void
+luaminiflac_pack_pcm(uint8_t* out, int32_t** samples, uint8_t channels, uint32_t block_size, uint8_t bps, LUAMINIFLAC_PCM format) {
+    if(bps == 0 || bps > 32) bps = 32;
+    if(channels >= 1 && channels <= 2 && luaminiflac_pack_kernels[format][channels - 1] != NULL) {
+        luaminiflac_pack_kernels[format][channels - 1](out,samples,block_size,bps);
+        return;
+    }
+    luaminiflac_pack_pcm_scalar(out,samples,channels,0,block_size,bps,format);
+}
+
+#endif
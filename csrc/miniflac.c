@@ -1,10 +1,15 @@
-#define LUAMINIFLAC_VERSION_MAJOR 1
-#define LUAMINIFLAC_VERSION_MINOR 1
-#define LUAMINIFLAC_VERSION_PATCH 1
+#define LUAMINIFLAC_VERSION_MAJOR 2
+#define LUAMINIFLAC_VERSION_MINOR 0
+#define LUAMINIFLAC_VERSION_PATCH 0
 #define STR(x) #x
 #define XSTR(x) STR(x)
 #define LUAMINIFLAC_VERSION XSTR(LUAMINIFLAC_VERSION_MAJOR) "." XSTR(LUAMINIFLAC_VERSION_MINOR) "." XSTR(LUAMINIFLAC_VERSION_PATCH)
 
+/* 64-bit off_t on 32-bit targets, so files over 2 GiB can be opened */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdint.h>
@@ -13,6 +18,62 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define luaminiflac_open_fd(path) _open((path),_O_RDONLY | _O_BINARY)
+#define luaminiflac_read_fd(fd,buf,len) _read((fd),(buf),(unsigned int)(len))
+#define luaminiflac_seek_fd(fd,off,whence) _lseeki64((fd),(off),(whence))
+#define luaminiflac_close_fd(fd) _close(fd)
+#define luaminiflac_fseek(f,off,whence) _fseeki64((f),(off),(whence))
+#define luaminiflac_ftell(f) _ftelli64(f)
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define luaminiflac_open_fd(path) open((path),O_RDONLY)
+#define luaminiflac_read_fd(fd,buf,len) read((fd),(buf),(len))
+#define luaminiflac_seek_fd(fd,off,whence) lseek((fd),(off),(whence))
+#define luaminiflac_close_fd(fd) close(fd)
+#define luaminiflac_fseek(f,off,whence) fseeko((f),(off_t)(off),(whence))
+#define luaminiflac_ftell(f) ftello(f)
+#endif
+
+/* how much is read from a file at a time */
+#define LUAMINIFLAC_READ_SIZE 65536
+
+#include "luaminiflac_pcm.h"
+
+/* 64-bit fields are pushed as plain integers when lua_Integer is 64
+ * bits (Lua 5.3+). define LUAMINIFLAC_NATIVE_INTEGERS=0 to always get
+ * miniflac_uint64_t userdata instead */
+#ifndef LUAMINIFLAC_NATIVE_INTEGERS
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 503 \
+  && defined(LUA_MAXINTEGER) && LUA_MAXINTEGER >= 0x7FFFFFFFFFFFFFFF
+#define LUAMINIFLAC_NATIVE_INTEGERS 1
+#else
+#define LUAMINIFLAC_NATIVE_INTEGERS 0
+#endif
+#endif
+
+/* define LUAMINIFLAC_TIMING to have :stats() include time spent
+ * in each part of decoding, at the cost of reading a clock a few
+ * times per call. the counters are always kept */
+#ifdef LUAMINIFLAC_TIMING
+#define LUAMINIFLAC_TIMER(t) uint64_t t = 0;
+#define LUAMINIFLAC_TIMER_START(t) (t = luaminiflac_now())
+#define LUAMINIFLAC_TIMER_ADD(t,total) ((total) += luaminiflac_now() - t)
+#else
+#define LUAMINIFLAC_TIMER(t)
+#define LUAMINIFLAC_TIMER_START(t) ((void)0)
+#define LUAMINIFLAC_TIMER_ADD(t,total) ((void)0)
+#endif
 
 #define MINIFLAC_API static
 #define MINIFLAC_PRIVATE static inline
@@ -34,6 +95,24 @@ extern "C" {
 LUAMINIFLAC_PUBLIC
 int luaopen_miniflac(lua_State *L);
 
+/* the C ABI used by miniflac.ffi under LuaJIT */
+struct luaminiflac_ffi_s;
+
+LUAMINIFLAC_PUBLIC
+struct luaminiflac_ffi_s* luaminiflac_ffi_new(int container);
+
+LUAMINIFLAC_PUBLIC
+void luaminiflac_ffi_free(struct luaminiflac_ffi_s* dec);
+
+LUAMINIFLAC_PUBLIC
+int luaminiflac_ffi_reset(struct luaminiflac_ffi_s* dec, int container);
+
+LUAMINIFLAC_PUBLIC
+int luaminiflac_ffi_sync(struct luaminiflac_ffi_s* dec, const uint8_t* data, uint32_t len, uint32_t* used);
+
+LUAMINIFLAC_PUBLIC
+int luaminiflac_ffi_decode(struct luaminiflac_ffi_s* dec, const uint8_t* data, uint32_t len, uint32_t* used);
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,6 +120,10 @@ int luaopen_miniflac(lua_State *L);
 #define MINIFLAC_IMPLEMENTATION
 #include "miniflac/miniflac.h"
 
+/* returned in place of a MINIFLAC_RESULT by decode_into when the frame
+ * doesn't fit the samplebuf, below every miniflac error code */
+#define LUAMINIFLAC_SAMPLEBUF_TOO_SMALL (-100)
+
 /* compat funcs {{{ */
 #define luaminiflac_push_const(x) lua_pushinteger(L,MINIFLAC_ ## x) ; lua_setfield(L,-2, "MINIFLAC_" #x)
 
@@ -97,6 +180,9 @@ static const char* const luaminiflac_digits          = "0123456789";
 static const char* const luaminiflac_int64_mt        = "miniflac_int64_t";
 static const char* const luaminiflac_uint64_mt       = "miniflac_uint64_t";
 static const char* const luaminiflac_mt     = "miniflac_t";
+static const char* const luaminiflac_samplebuf_mt = "miniflac_samplebuf_t";
+static const char* const luaminiflac_index_mt = "miniflac_index_t";
+static const char* const luaminiflac_async_mt = "miniflac_async_t";
 
 static const char* const luaminiflac_metadata_strs[] = {
     "streaminfo",
@@ -110,6 +196,31 @@ static const char* const luaminiflac_metadata_strs[] = {
     "unknown",
 };
 
+static const char* const luaminiflac_pcm_formats[] = {
+    "s16",
+    "s24",
+    "s32",
+    "f32",
+    NULL,
+};
+
+static const uint8_t luaminiflac_pcm_sizes[] = { 2, 3, 4, 4 };
+
+/* which channels decoding hands back, see :set_channels() */
+typedef enum LUAMINIFLAC_OUTPUT {
+    LUAMINIFLAC_OUTPUT_ALL = 0,
+    LUAMINIFLAC_OUTPUT_MONO = 1,
+    LUAMINIFLAC_OUTPUT_STEREO = 2,
+    LUAMINIFLAC_OUTPUT_SELECT = 3,
+} LUAMINIFLAC_OUTPUT;
+
+static const char* const luaminiflac_output_modes[] = {
+    "all",
+    "mono",
+    "stereo",
+    NULL,
+};
+
 typedef struct luaminiflac_metamethods_s {
     const char *name;
     const char *metaname;
@@ -121,14 +232,102 @@ typedef struct luaminiflac_closures_s {
     const char* name;
 } luaminiflac_closures_t;
 
+typedef struct luaminiflac_md5_s {
+    uint32_t state[4];
+    uint64_t length;   /* bytes hashed so far */
+    uint8_t block[64];
+} luaminiflac_md5_t;
+
+typedef struct luaminiflac_stats_s {
+    uint64_t bytes;          /* input consumed */
+    uint64_t frames;         /* frames decoded */
+    uint64_t samples;        /* samples decoded, per channel */
+    uint64_t sync_retries;   /* calls that ran out of data */
+    uint64_t resyncs;        /* frame headers found after junk */
+    uint64_t skipped;        /* bytes of junk before those headers */
+    uint64_t crc8_errors;
+    uint64_t crc16_errors;
+    uint64_t errors;         /* every error, CRC failures included */
+    uint64_t sync_time;      /* nanoseconds, with LUAMINIFLAC_TIMING */
+    uint64_t decode_time;
+    uint64_t marshal_time;   /* building sample tables and PCM strings */
+    uint64_t copy_time;      /* copying input in and remainders out */
+} luaminiflac_stats_t;
+
 typedef struct luaminiflac_s {
     miniflac_t flac;
-    int32_t samplebuf[8 * 65535];
+    int32_t* samplebuf;       /* allocated on the first decoded frame */
+    uint32_t sample_capacity; /* samples per channel in samplebuf */
+    uint8_t sample_channels;
+    uint8_t metadata_only;
+    uint8_t meta_step;   /* progress through a read_* block parser, 0 = not started */
+    uint8_t meta_sub;    /* progress within the current seekpoint/track/etc */
+    uint8_t meta_subsub; /* progress within the current index point */
+    uint32_t meta_i;
+    uint32_t meta_j;
+    uint32_t meta_count;
+    uint32_t meta_count2;
+    uint32_t meta_len;   /* length of the string being read */
     int32_t* samples[8];
     uint8_t* buffer;
     uint32_t buffer_len;
+    uint8_t* input;     /* rolling input buffer filled by :feed() */
+    size_t input_len;   /* bytes stored in input */
+    size_t input_pos;   /* bytes of input already consumed */
+    size_t input_cap;
+    int fd;             /* file the input is read from, or -1 */
+    uint8_t fd_eof;
+    uint8_t fd_owned;   /* opened by miniflac.open, closed with the decoder */
+    uint8_t* map;       /* file mapped by miniflac.mmap, used as the input buffer */
+    size_t map_len;
+    MINIFLAC_CONTAINER container;
+    luaminiflac_md5_t md5; /* running hash of decoded audio */
+    uint8_t md5_enabled;
+    uint8_t md5_expected_set;
+    uint8_t md5_expected[16]; /* from STREAMINFO, whichever call parsed it */
+    luaminiflac_stats_t stats;
+    uint8_t output;      /* LUAMINIFLAC_OUTPUT */
+    uint8_t output_count; /* channels in output_select */
+    uint8_t output_select[8]; /* 0-based channel numbers */
+    int32_t* mixbuf;     /* downmixed samples, allocated on first use */
+    uint32_t mix_capacity; /* samples per channel in mixbuf */
 } luaminiflac_t;
 
+/* reusable, planar sample storage that decode_into writes into directly */
+typedef struct luaminiflac_samplebuf_s {
+    uint32_t channels;   /* allocated channels */
+    uint32_t capacity;   /* allocated samples per channel */
+    uint32_t frame_channels; /* channels in the last decoded frame */
+    uint32_t length;     /* samples per channel in the last decoded frame */
+    uint32_t sample_rate;
+    uint8_t bps;
+    int32_t* samples[8];
+    int32_t data[];
+} luaminiflac_samplebuf_t;
+
+/* one entry per audio frame, for seeking without searching */
+typedef struct luaminiflac_index_entry_s {
+    uint64_t offset;     /* byte offset of the frame header */
+    uint64_t sample;     /* first sample of the frame */
+    uint32_t block_size;
+} luaminiflac_index_entry_t;
+
+typedef struct luaminiflac_index_s {
+    luaminiflac_index_entry_t* entries;
+    size_t count;
+    size_t capacity;
+    uint32_t block_size; /* shared by every frame but the last, 0 if they vary */
+} luaminiflac_index_t;
+
+typedef struct luaminiflac_input_s {
+    const char* str;
+    size_t len;
+    size_t pos;
+    int at;
+    luaminiflac_t* buffered; /* set when reading from the rolling input buffer */
+    luaminiflac_t* owner;    /* decoder the input is for, if any */
+} luaminiflac_input_t;
+
 typedef MINIFLAC_RESULT (*luaminiflac_uint8_func)(miniflac_t* pFlac, const uint8_t* data, uint32_t length, uint32_t* out_length, uint8_t* value);
 typedef MINIFLAC_RESULT (*luaminiflac_uint16_func)(miniflac_t* pFlac, const uint8_t* data, uint32_t length, uint32_t* out_length, uint16_t* value);
 typedef MINIFLAC_RESULT (*luaminiflac_uint32_func)(miniflac_t* pFlac, const uint8_t* data, uint32_t length, uint32_t* out_length, uint32_t* value);
@@ -136,6 +335,15 @@ typedef MINIFLAC_RESULT (*luaminiflac_uint64_func)(miniflac_t* pFlac, const uint
 
 typedef MINIFLAC_RESULT (*luaminiflac_str_func)(miniflac_t* pFlac, const uint8_t* data, uint32_t length, uint32_t* out_length, uint8_t* buffer, uint32_t buffer_length, uint32_t* buffer_used);
 
+/* a slice of input shared by the steps of a block parser */
+typedef struct luaminiflac_reader_s {
+    const uint8_t* data;
+    uint32_t len;
+    uint32_t used;
+} luaminiflac_reader_t;
+
+typedef MINIFLAC_RESULT (*luaminiflac_block_func)(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd);
+
 /* uint64 and int64 {{{ */
 static char *
 luaminiflac_uint64_to_str(uint64_t value, char buffer[21], size_t *len) {
@@ -169,16 +377,26 @@ luaminiflac_int64_to_str(int64_t value, char buffer[22], size_t *len) {
     return p;
 }
 
+/* pushes an unsigned 64-bit field. with native integers, values
+ * that fit in a lua_Integer are pushed as plain integers, anything
+ * else becomes a miniflac_uint64_t userdata */
 static void
-luaminiflac_pushuint64(lua_State *L, int64_t val) {
-    int64_t *t = NULL;
+luaminiflac_pushuint64(lua_State *L, uint64_t val) {
+    uint64_t *t = NULL;
+
+#if LUAMINIFLAC_NATIVE_INTEGERS
+    if(val <= (uint64_t)LUA_MAXINTEGER) {
+        lua_pushinteger(L,(lua_Integer)val);
+        return;
+    }
+#endif
 
-    t = lua_newuserdata(L,sizeof(int64_t));
+    t = lua_newuserdata(L,sizeof(uint64_t));
     if(t == NULL) {
         luaL_error(L,"out of memory");
     }
     *t = val;
-    luaL_setmetatable(L,luaminiflac_int64_mt);
+    luaL_setmetatable(L,luaminiflac_uint64_mt);
 }
 
 static inline int64_t
@@ -332,6 +550,15 @@ luaminiflac_touint64(lua_State *L, int idx) {
     return tmp;
 }
 
+/* a required, non-negative 64-bit argument: a number, a string, or
+ * the userdata luaminiflac_pushuint64 gives when lua_Integer is small */
+static uint64_t
+luaminiflac_checkuint64(lua_State *L, int arg, const char* msg) {
+    luaL_checkany(L,arg);
+    luaL_argcheck(L,lua_type(L,arg) != LUA_TNUMBER || lua_tonumber(L,arg) >= 0,arg,msg);
+    return luaminiflac_touint64(L,arg);
+}
+
 
 static int
 luaminiflac_uint64(lua_State *L) {
@@ -1024,9 +1251,572 @@ static const struct luaL_Reg luaminiflac_uint64_metamethods[] = {
 };
 
 /* }}} */
+
+/* threads {{{ */
+
+typedef void (*luaminiflac_thread_func)(void* arg);
+
+typedef struct luaminiflac_thread_s {
+    luaminiflac_thread_func func;
+    void* arg;
+    int started;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} luaminiflac_thread_t;
+
+#ifdef _WIN32
+static DWORD WINAPI
+luaminiflac_thread_entry(LPVOID p) {
+    luaminiflac_thread_t* t = (luaminiflac_thread_t*)p;
+    t->func(t->arg);
+    return 0;
+}
+#else
+static void*
+luaminiflac_thread_entry(void* p) {
+    luaminiflac_thread_t* t = (luaminiflac_thread_t*)p;
+    t->func(t->arg);
+    return NULL;
+}
+#endif
+
+/* runs func on a new thread, returns 0 if the thread
+ * couldn't be created. t has to stay put until joined */
+static int
+luaminiflac_thread_start(luaminiflac_thread_t* t, luaminiflac_thread_func func, void* arg) {
+    t->func = func;
+    t->arg = arg;
+#ifdef _WIN32
+    t->handle = CreateThread(NULL,0,luaminiflac_thread_entry,t,0,NULL);
+    t->started = t->handle != NULL;
+#else
+    t->started = pthread_create(&t->handle,NULL,luaminiflac_thread_entry,t) == 0;
+#endif
+    return t->started;
+}
+
+static void
+luaminiflac_thread_join(luaminiflac_thread_t* t) {
+    if(!t->started) return;
+#ifdef _WIN32
+    WaitForSingleObject(t->handle,INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle,NULL);
+#endif
+    t->started = 0;
+}
+
+/* a mutex and condition variable, for a thread to sleep on */
+typedef struct luaminiflac_event_s {
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} luaminiflac_event_t;
+
+#ifdef _WIN32
+#define luaminiflac_event_init(e) (InitializeCriticalSection(&(e)->mutex), InitializeConditionVariable(&(e)->cond))
+#define luaminiflac_event_free(e) DeleteCriticalSection(&(e)->mutex)
+#define luaminiflac_event_lock(e) EnterCriticalSection(&(e)->mutex)
+#define luaminiflac_event_unlock(e) LeaveCriticalSection(&(e)->mutex)
+#define luaminiflac_event_wait(e) SleepConditionVariableCS(&(e)->cond,&(e)->mutex,INFINITE)
+#define luaminiflac_event_signal(e) WakeConditionVariable(&(e)->cond)
+#else
+#define luaminiflac_event_init(e) (pthread_mutex_init(&(e)->mutex,NULL), pthread_cond_init(&(e)->cond,NULL))
+#define luaminiflac_event_free(e) (pthread_cond_destroy(&(e)->cond), pthread_mutex_destroy(&(e)->mutex))
+#define luaminiflac_event_lock(e) pthread_mutex_lock(&(e)->mutex)
+#define luaminiflac_event_unlock(e) pthread_mutex_unlock(&(e)->mutex)
+#define luaminiflac_event_wait(e) pthread_cond_wait(&(e)->cond,&(e)->mutex)
+#define luaminiflac_event_signal(e) pthread_cond_signal(&(e)->cond)
+#endif
+
+/* counters shared between two threads, loads acquire and stores release */
+#ifdef _MSC_VER
+static size_t
+luaminiflac_atomic_load(volatile size_t* p) {
+    size_t v = *p;
+    MemoryBarrier();
+    return v;
+}
+
+static void
+luaminiflac_atomic_store(volatile size_t* p, size_t v) {
+    MemoryBarrier();
+    *p = v;
+}
+#else
+static size_t
+luaminiflac_atomic_load(volatile size_t* p) {
+    return __atomic_load_n(p,__ATOMIC_ACQUIRE);
+}
+
+static void
+luaminiflac_atomic_store(volatile size_t* p, size_t v) {
+    __atomic_store_n(p,v,__ATOMIC_RELEASE);
+}
+#endif
+
+static unsigned int
+luaminiflac_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (unsigned int)info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+#ifdef LUAMINIFLAC_TIMING
+/* a monotonic clock in nanoseconds */
+static uint64_t
+luaminiflac_now(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if(freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart / (uint64_t)freq.QuadPart * 1000000000ULL +
+      (uint64_t)now.QuadPart % (uint64_t)freq.QuadPart * 1000000000ULL / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+#endif
+
+/* }}} */
+
+/* md5 {{{ */
+
+static const uint32_t luaminiflac_md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t luaminiflac_md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void
+luaminiflac_md5_init(luaminiflac_md5_t* md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xefcdab89;
+    md5->state[2] = 0x98badcfe;
+    md5->state[3] = 0x10325476;
+    md5->length = 0;
+}
+
+static void
+luaminiflac_md5_transform(luaminiflac_md5_t* md5, const uint8_t* block) {
+    uint32_t m[16];
+    uint32_t a = md5->state[0];
+    uint32_t b = md5->state[1];
+    uint32_t c = md5->state[2];
+    uint32_t d = md5->state[3];
+    uint32_t f = 0;
+    uint32_t t = 0;
+    unsigned int g = 0;
+    unsigned int i = 0;
+
+    for(i=0;i<16;i++) {
+        m[i] = (uint32_t)block[i*4]
+          | ((uint32_t)block[i*4+1] << 8)
+          | ((uint32_t)block[i*4+2] << 16)
+          | ((uint32_t)block[i*4+3] << 24);
+    }
+
+    for(i=0;i<64;i++) {
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        t = a + f + luaminiflac_md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ((t << luaminiflac_md5_r[i]) | (t >> (32 - luaminiflac_md5_r[i])));
+    }
+
+    md5->state[0] += a;
+    md5->state[1] += b;
+    md5->state[2] += c;
+    md5->state[3] += d;
+}
+
+static void
+luaminiflac_md5_update(luaminiflac_md5_t* md5, const uint8_t* data, size_t len) {
+    size_t fill = (size_t)(md5->length & 63);
+    size_t n = 0;
+
+    md5->length += len;
+
+    if(fill > 0) {
+        n = 64 - fill < len ? 64 - fill : len;
+        memcpy(&md5->block[fill],data,n);
+        data += n;
+        len -= n;
+        if(fill + n < 64) return;
+        luaminiflac_md5_transform(md5,md5->block);
+    }
+
+    while(len >= 64) {
+        luaminiflac_md5_transform(md5,data);
+        data += 64;
+        len -= 64;
+    }
+
+    if(len > 0) {
+        memcpy(md5->block,data,len);
+    }
+}
+
+/* finishes a copy of the hash, so hashing can continue */
+static void
+luaminiflac_md5_digest(const luaminiflac_md5_t* md5, uint8_t digest[16]) {
+    luaminiflac_md5_t tmp = *md5;
+    uint8_t pad[72];
+    uint64_t bits = md5->length * 8;
+    size_t fill = (size_t)(md5->length & 63);
+    size_t padlen = fill < 56 ? 56 - fill : 120 - fill;
+    unsigned int i = 0;
+
+    memset(pad,0,sizeof(pad));
+    pad[0] = 0x80;
+    for(i=0;i<8;i++) {
+        pad[padlen + i] = (uint8_t)(bits >> (8 * i));
+    }
+    luaminiflac_md5_update(&tmp,pad,padlen + 8);
+
+    for(i=0;i<16;i++) {
+        digest[i] = (uint8_t)(tmp.state[i/4] >> (8 * (i % 4)));
+    }
+}
+
+/* hashes a decoded frame the way the FLAC encoder does: interleaved,
+ * signed, little-endian samples, (bps + 7) / 8 bytes each */
+static void
+luaminiflac_md5_frame(luaminiflac_md5_t* md5, int32_t** samples, uint32_t channels, uint32_t block_size, uint8_t bps) {
+    uint8_t buf[2048];
+    size_t pos = 0;
+    uint32_t bytes = ((uint32_t)bps + 7) / 8;
+    uint32_t i = 0;
+    uint32_t c = 0;
+    uint32_t b = 0;
+    uint32_t s = 0;
+
+    for(i=0;i<block_size;i++) {
+        if(pos + bytes * channels > sizeof(buf)) {
+            luaminiflac_md5_update(md5,buf,pos);
+            pos = 0;
+        }
+        for(c=0;c<channels;c++) {
+            s = (uint32_t)samples[c][i];
+            for(b=0;b<bytes;b++) {
+                buf[pos++] = (uint8_t)(s >> (8 * b));
+            }
+        }
+    }
+    luaminiflac_md5_update(md5,buf,pos);
+}
+
+/* }}} */
+
+/* input handling {{{ */
+
+/* makes room for len more bytes in the rolling input buffer, moving
+ * any unconsumed bytes to the front before growing it */
+static void
+luaminiflac_reserve_input(lua_State* L, int idx, luaminiflac_t *lFlac, size_t len) {
+    size_t remain = lFlac->input_len - lFlac->input_pos;
+    size_t cap = 0;
+    uint8_t* input = NULL;
+
+    if(lFlac->input_pos > 0) {
+        if(remain > 0) {
+            memmove(lFlac->input,&lFlac->input[lFlac->input_pos],remain);
+        }
+        lFlac->input_len = remain;
+        lFlac->input_pos = 0;
+    }
+
+    if(remain + len > lFlac->input_cap) {
+        cap = lFlac->input_cap ? lFlac->input_cap : 4096;
+        while(cap < remain + len) {
+            cap *= 2;
+        }
+
+        lua_getuservalue(L,idx);
+        input = lua_newuserdata(L,cap);
+        if(input == NULL) {
+            luaL_error(L,"out of memory");
+            return;
+        }
+        if(remain > 0) {
+            memcpy(input,lFlac->input,remain);
+        }
+        lFlac->input = input;
+        lFlac->input_cap = cap;
+        lua_setfield(L,-2,"input");
+        lua_pop(L,1);
+    }
+}
+
+/* reads more of the decoder's file into the rolling input buffer,
+ * returns the number of bytes read, 0 at the end of the file */
+static size_t
+luaminiflac_refill(lua_State* L, int idx, luaminiflac_t* lFlac) {
+    size_t space = 0;
+    long n = 0;
+
+    if(lFlac->fd < 0 || lFlac->fd_eof) return 0;
+
+    luaminiflac_reserve_input(L,idx,lFlac,LUAMINIFLAC_READ_SIZE);
+    space = lFlac->input_cap - lFlac->input_len;
+    if(space > 0x40000000) space = 0x40000000;
+
+    do {
+        n = (long)luaminiflac_read_fd(lFlac->fd,&lFlac->input[lFlac->input_len],space);
+    } while(n < 0 && errno == EINTR);
+
+    if(n < 0) {
+        luaL_error(L,"read error: %s",strerror(errno));
+        return 0;
+    }
+    if(n == 0) {
+        lFlac->fd_eof = 1;
+        return 0;
+    }
+    lFlac->input_len += (size_t)n;
+    return (size_t)n;
+}
+
+/* reads the input arguments starting at idx, either (data) or,
+ * for the _at variants, (data, pos) where pos is a 1-based byte offset.
+ * if data is nil, the rolling input buffer filled by :feed() is used,
+ * for a decoder reading from a file it's topped up first.
+ * returns the index of the next argument */
+static int
+luaminiflac_checkinput(lua_State* L, int idx, luaminiflac_t* lFlac, int at, luaminiflac_input_t* in) {
+    lua_Integer pos = 1;
+
+    in->at = at;
+    in->buffered = NULL;
+    in->owner = lFlac;
+
+    if(lua_isnoneornil(L,idx) && lFlac != NULL) {
+        if(lFlac->input_len - lFlac->input_pos < LUAMINIFLAC_READ_SIZE) {
+            luaminiflac_refill(L,1,lFlac);
+        }
+        in->str = (const char*)lFlac->input;
+        in->len = lFlac->input_len;
+        in->pos = lFlac->input_pos;
+        in->buffered = lFlac;
+        return idx + (at ? 2 : 1);
+    }
+
+    in->str = lua_tolstring(L,idx,&in->len);
+    if(in->str == NULL) {
+        return luaL_error(L,"missing data");
+    }
+    in->pos = 0;
+
+    if(at) {
+        pos = luaL_optinteger(L,idx+1,1);
+        if(pos < 1 || (size_t)pos > in->len + 1) {
+            return luaL_argerror(L,idx+1,"position out of range");
+        }
+        in->pos = (size_t)(pos - 1);
+        return idx + 2;
+    }
+    return idx + 1;
+}
+
+/* when reading from a file, consumes the used input and reads more,
+ * so a call that ran out of data can carry on. returns 0 at the end
+ * of the file, or if the decoder isn't reading from a file */
+static int
+luaminiflac_input_more(lua_State* L, luaminiflac_input_t* in, uint32_t* used) {
+    luaminiflac_t* lFlac = in->buffered;
+
+    if(lFlac == NULL || lFlac->fd < 0) return 0;
+
+    lFlac->input_pos += *used;
+    lFlac->stats.bytes += *used;
+    *used = 0;
+    if(luaminiflac_refill(L,1,lFlac) == 0) return 0;
+
+    in->str = (const char*)lFlac->input;
+    in->len = lFlac->input_len;
+    in->pos = lFlac->input_pos;
+    return 1;
+}
+
+static inline const uint8_t*
+luaminiflac_input_data(const luaminiflac_input_t* in) {
+    return (const uint8_t*)&in->str[in->pos];
+}
+
+/* miniflac takes 32-bit lengths, larger inputs are
+ * processed in pieces by repeated calls */
+static inline uint32_t
+luaminiflac_input_len(const luaminiflac_input_t* in) {
+    size_t len = in->len - in->pos;
+    return len > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)len;
+}
+
+/* pushes the un-processed remainder of the input, for the
+ * _at variants this is the position of the next unprocessed byte.
+ * when reading from the rolling input buffer, the used bytes are
+ * consumed and the number of bytes still buffered is pushed */
+static void
+luaminiflac_push_remain(lua_State* L, const luaminiflac_input_t* in, uint32_t used) {
+    LUAMINIFLAC_TIMER(t)
+
+    if(in->owner != NULL) in->owner->stats.bytes += used;
+    if(in->buffered != NULL) {
+        in->buffered->input_pos += used;
+        lua_pushinteger(L,(lua_Integer)(in->buffered->input_len - in->buffered->input_pos));
+        return;
+    }
+    if(in->at) {
+        lua_pushinteger(L,(lua_Integer)(in->pos + used + 1));
+        return;
+    }
+    LUAMINIFLAC_TIMER_START(t);
+    lua_pushlstring(L,&in->str[in->pos + used],in->len - in->pos - used);
+    if(in->owner != NULL) LUAMINIFLAC_TIMER_ADD(t,in->owner->stats.copy_time);
+}
+
+static void
+luaminiflac_count_error(luaminiflac_t* lFlac, MINIFLAC_RESULT r) {
+    lFlac->stats.errors++;
+    if(r == MINIFLAC_FRAME_CRC8_INVALID) lFlac->stats.crc8_errors++;
+    if(r == MINIFLAC_FRAME_CRC16_INVALID) lFlac->stats.crc16_errors++;
+}
+
+#define luaminiflac_result_case(x) case MINIFLAC_ ## x: return "MINIFLAC_" #x
+
+/* the name of a MINIFLAC_RESULT, for error messages */
+static const char*
+luaminiflac_result_name(MINIFLAC_RESULT r) {
+    switch(r) {
+        luaminiflac_result_case(SUBFRAME_RESERVED_TYPE);
+        luaminiflac_result_case(SUBFRAME_RESERVED_BIT);
+        luaminiflac_result_case(STREAMMARKER_INVALID);
+        luaminiflac_result_case(RESERVED_CODING_METHOD);
+        luaminiflac_result_case(METADATA_TYPE_RESERVED);
+        luaminiflac_result_case(METADATA_TYPE_INVALID);
+        luaminiflac_result_case(FRAME_RESERVED_SAMPLE_SIZE);
+        luaminiflac_result_case(FRAME_RESERVED_CHANNEL_ASSIGNMENT);
+        luaminiflac_result_case(FRAME_INVALID_SAMPLE_SIZE);
+        luaminiflac_result_case(FRAME_INVALID_SAMPLE_RATE);
+        luaminiflac_result_case(FRAME_RESERVED_BLOCKSIZE);
+        luaminiflac_result_case(FRAME_RESERVED_BIT2);
+        luaminiflac_result_case(FRAME_RESERVED_BIT1);
+        luaminiflac_result_case(FRAME_SYNCCODE_INVALID);
+        luaminiflac_result_case(FRAME_CRC16_INVALID);
+        luaminiflac_result_case(FRAME_CRC8_INVALID);
+        luaminiflac_result_case(ERROR);
+        luaminiflac_result_case(CONTINUE);
+        luaminiflac_result_case(OK);
+        luaminiflac_result_case(METADATA_END);
+        default: break;
+    }
+    return "unknown result";
+}
+
+/* pushes a miniflac error code, and counts it */
+static void
+luaminiflac_push_error(lua_State* L, luaminiflac_t* lFlac, MINIFLAC_RESULT r) {
+    luaminiflac_count_error(lFlac,r);
+    lua_pushinteger(L,r);
+}
+
+static void
+luaminiflac_count_frame(luaminiflac_t* lFlac) {
+    lFlac->stats.frames++;
+    lFlac->stats.samples += lFlac->flac.frame.header.block_size;
+}
+
+/* when a frame header is expected but the data doesn't start with a
+ * sync code, miniflac will skip ahead to the next one. this is only
+ * counted once the header is in the data, so retries don't count twice.
+ * a header split across calls leaves the parser past its sync step, or
+ * with the 0xFF byte held in the bit reader, so data[0] isn't checked then */
+static void
+luaminiflac_count_resync(luaminiflac_t* lFlac, const uint8_t* data, uint32_t len) {
+    const uint8_t* p = NULL;
+
+    if(len == 0 || data[0] == 0xFF) return;
+    if(lFlac->flac.state != MINIFLAC_FRAME || lFlac->flac.frame.state != MINIFLAC_FRAME_HEADER) return;
+    if(lFlac->flac.frame.header.state != MINIFLAC_FRAME_HEADER_SYNC || lFlac->flac.br.bits != 0) return;
+
+    p = memchr(data,0xFF,len);
+    while(p != NULL && (size_t)(p - data) + 1 < len && (p[1] & 0xFE) != 0xF8) {
+        p = memchr(p + 1,0xFF,len - (size_t)(p - data) - 1);
+    }
+    if(p == NULL || (size_t)(p - data) + 1 >= len) return;
+    lFlac->stats.resyncs++;
+    lFlac->stats.skipped += (uint64_t)(p - data);
+}
+
+/* when the input runs out, checks whether the decoder stopped partway
+ * through a metadata block or frame, not at a clean end of stream */
+static int
+luaminiflac_truncated(const luaminiflac_t* lFlac) {
+    if(lFlac->input_len > lFlac->input_pos) return 1;
+    if(lFlac->flac.br.bits != 0) return 1;
+    if(lFlac->flac.state == MINIFLAC_METADATA) return 1;
+    return lFlac->flac.state == MINIFLAC_FRAME
+      && (lFlac->flac.frame.state != MINIFLAC_FRAME_HEADER
+        || lFlac->flac.frame.header.state != MINIFLAC_FRAME_HEADER_SYNC);
+}
+
+/* }}} */
+
 static void
 luaminiflac_expand_buffer(lua_State* L, int idx, luaminiflac_t *lFlac, uint32_t len) {
-    if(len < lFlac->buffer_len) return;
+    /* strings may be read over several calls, so the buffer
+     * must not be replaced unless it needs to grow */
+    if(len <= lFlac->buffer_len) return;
 
     lua_getuservalue(L,idx);
     lFlac->buffer = lua_newuserdata(L,len);
@@ -1039,39 +1829,89 @@ luaminiflac_expand_buffer(lua_State* L, int idx, luaminiflac_t *lFlac, uint32_t
     lua_pop(L,1);
 }
 
+/* sizes the sample storage for a frame, it's allocated on the
+ * first frame decoded and only grows if a larger frame comes along */
+static void
+luaminiflac_expand_samples(lua_State* L, int idx, luaminiflac_t *lFlac, uint8_t channels, uint32_t block_size) {
+    int32_t* samplebuf = NULL;
+    unsigned int c = 0;
+
+    if(channels <= lFlac->sample_channels && block_size <= lFlac->sample_capacity) return;
+    if(channels < lFlac->sample_channels) channels = lFlac->sample_channels;
+    if(block_size < lFlac->sample_capacity) block_size = lFlac->sample_capacity;
+
+    lua_getuservalue(L,idx);
+    samplebuf = lua_newuserdata(L,sizeof(int32_t) * (size_t)channels * (size_t)block_size);
+    if(samplebuf == NULL) {
+        luaL_error(L,"out of memory");
+        return;
+    }
+    lua_setfield(L,-2,"samples");
+    lua_pop(L,1);
+
+    lFlac->samplebuf = samplebuf;
+    lFlac->sample_channels = channels;
+    lFlac->sample_capacity = block_size;
+    for(c=0;c<8;c++) {
+        lFlac->samples[c] = c < channels ? &samplebuf[c * block_size] : NULL;
+    }
+}
 
+/* appends data to the rolling input buffer */
 static void
-luaminiflac_push_frame_header(lua_State* L, luaminiflac_t* lFlac) {
-    lua_newtable(L);
+luaminiflac_feed(lua_State* L, int idx, luaminiflac_t *lFlac, const char* data, size_t len) {
+    LUAMINIFLAC_TIMER(t)
+
+    LUAMINIFLAC_TIMER_START(t);
+    luaminiflac_reserve_input(L,idx,lFlac,len);
+    memcpy(&lFlac->input[lFlac->input_len],data,len);
+    lFlac->input_len += len;
+    LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.copy_time);
+}
+
 
-    lua_pushinteger(L,lFlac->flac.frame.header.blocking_strategy);
+/* fills in the frame header table on top of the stack, it may be
+ * one reused from an earlier frame */
+static void
+luaminiflac_set_frame_header(lua_State* L, const miniflac_frame_header_t* header) {
+    lua_pushinteger(L,header->blocking_strategy);
     lua_setfield(L,-2,"blocking_strategy");
-    lua_pushinteger(L,lFlac->flac.frame.header.block_size);
+    lua_pushinteger(L,header->block_size);
     lua_setfield(L,-2,"block_size");
-    lua_pushinteger(L,lFlac->flac.frame.header.sample_rate);
+    lua_pushinteger(L,header->sample_rate);
     lua_setfield(L,-2,"sample_rate");
-    switch(lFlac->flac.frame.header.channel_assignment) {
+    switch(header->channel_assignment) {
         case MINIFLAC_CHASSGN_NONE: lua_pushstring(L,"independent"); break;
         case MINIFLAC_CHASSGN_LEFT_SIDE: lua_pushstring(L,"left_side_stereo"); break;
         case MINIFLAC_CHASSGN_RIGHT_SIDE: lua_pushstring(L,"right_side_stereo"); break;
         case MINIFLAC_CHASSGN_MID_SIDE: lua_pushstring(L,"mid_side_stereo"); break;
     }
     lua_setfield(L,-2,"channel_assignment");
-    lua_pushinteger(L,lFlac->flac.frame.header.channels);
+    lua_pushinteger(L,header->channels);
     lua_setfield(L,-2,"channels");
-    lua_pushinteger(L,lFlac->flac.frame.header.bps);
+    lua_pushinteger(L,header->bps);
     lua_setfield(L,-2,"bps");
-    if(lFlac->flac.frame.header.blocking_strategy) { /* variable blocksize */
-        luaminiflac_pushuint64(L,lFlac->flac.frame.header.sample_number);
+    if(header->blocking_strategy) { /* variable blocksize */
+        luaminiflac_pushuint64(L,header->sample_number);
         lua_setfield(L,-2,"sample_number");
+        lua_pushnil(L);
+        lua_setfield(L,-2,"frame_number");
     } else {
-        lua_pushinteger(L,lFlac->flac.frame.header.frame_number);
+        lua_pushinteger(L,header->frame_number);
         lua_setfield(L,-2,"frame_number");
+        lua_pushnil(L);
+        lua_setfield(L,-2,"sample_number");
     }
-    lua_pushinteger(L,lFlac->flac.frame.header.crc8);
+    lua_pushinteger(L,header->crc8);
     lua_setfield(L,-2,"crc8");
 }
 
+static void
+luaminiflac_push_frame_header(lua_State* L, const miniflac_frame_header_t* header) {
+    lua_newtable(L);
+    luaminiflac_set_frame_header(L,header);
+}
+
 static void
 luaminiflac_push_header(lua_State* L, luaminiflac_t* lFlac) {
     const char* metadata_type = NULL;
@@ -1108,7 +1948,7 @@ luaminiflac_push_header(lua_State* L, luaminiflac_t* lFlac) {
     } else if(lFlac->flac.state == MINIFLAC_FRAME) {
         lua_newtable(L);
 
-        luaminiflac_push_frame_header(L,lFlac);
+        luaminiflac_push_frame_header(L,&lFlac->flac.frame.header);
         lua_setfield(L,-2,"header");
 
         lua_setfield(L,-2,"frame");
@@ -1121,32 +1961,286 @@ luaminiflac_push_header(lua_State* L, luaminiflac_t* lFlac) {
     }
 }
 
-static void
-luaminiflac_push_frame_samples(lua_State* L, luaminiflac_t* lFlac) {
-    uint8_t channel = 0;
-    uint32_t sample = 0;
+/* output channels {{{ */
+
+/* stereo downmix weights in Q14, { left, right } for each channel in
+ * FLAC's channel order. centre channels go to both sides at -3dB, LFE
+ * is dropped. mono adds the two sides together */
+#define LUAMINIFLAC_MIX_1 16384
+#define LUAMINIFLAC_MIX_H 11585
+static const uint16_t luaminiflac_downmix[8][8][2] = {
+    { { LUAMINIFLAC_MIX_1, LUAMINIFLAC_MIX_1 } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H },
+      { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H },
+      { 0, 0 }, { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H },
+      { 0, 0 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H }, { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H } },
+    { { LUAMINIFLAC_MIX_1, 0 }, { 0, LUAMINIFLAC_MIX_1 }, { LUAMINIFLAC_MIX_H, LUAMINIFLAC_MIX_H },
+      { 0, 0 }, { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H }, { LUAMINIFLAC_MIX_H, 0 }, { 0, LUAMINIFLAC_MIX_H } },
+};
 
-    lua_createtable(L,lFlac->flac.frame.header.channels,0);
-    while(channel<lFlac->flac.frame.header.channels) {
-        sample = 0;
-        lua_createtable(L,lFlac->flac.frame.header.block_size,0);
-        while(sample < lFlac->flac.frame.header.block_size) {
-            lua_pushinteger(L,lFlac->samples[channel][sample]);
-            lua_rawseti(L,-2,++sample);
+/* mixes every channel into out_channels (1 or 2) outputs. each output
+ * is divided by the sum of its weights, so it can't clip and keeps
+ * the source bps */
+static void
+luaminiflac_mix(int32_t** out, uint8_t out_channels, int32_t** samples, uint8_t channels, uint32_t block_size) {
+    const uint16_t (*w)[2] = luaminiflac_downmix[channels - 1];
+    int64_t weight[8];
+    int64_t total = 0;
+    int64_t acc = 0;
+    uint8_t o = 0;
+    uint8_t c = 0;
+    uint32_t i = 0;
+
+    for(o=0;o<out_channels;o++) {
+        total = 0;
+        for(c=0;c<channels;c++) {
+            weight[c] = out_channels == 1 ? (int64_t)w[c][0] + w[c][1] : (int64_t)w[c][o];
+            total += weight[c];
+        }
+        for(i=0;i<block_size;i++) {
+            acc = 0;
+            for(c=0;c<channels;c++) {
+                acc += weight[c] * samples[c][i];
+            }
+            acc += acc < 0 ? -(total / 2) : total / 2;
+            out[o][i] = (int32_t)(acc / total);
         }
-        lua_rawseti(L,-2,++channel);
     }
 }
 
 static void
-luaminiflac_push_frame_footer(lua_State* L, luaminiflac_t* lFlac) {
-    lua_newtable(L);
-    lua_pushinteger(L,lFlac->flac.frame.crc16);
+luaminiflac_expand_mixbuf(lua_State* L, int idx, luaminiflac_t* lFlac, uint32_t block_size) {
+    if(block_size <= lFlac->mix_capacity) return;
+
+    lua_getuservalue(L,idx);
+    lFlac->mixbuf = lua_newuserdata(L,sizeof(int32_t) * 2 * (size_t)block_size);
+    if(lFlac->mixbuf == NULL) {
+        luaL_error(L,"out of memory");
+        return;
+    }
+    lFlac->mix_capacity = block_size;
+    lua_setfield(L,-2,"mixbuf");
+    lua_pop(L,1);
+}
+
+/* how many channels the frame that was just decoded gets mixed
+ * down to, 0 if it isn't */
+static uint8_t
+luaminiflac_output_mix(const luaminiflac_t* lFlac) {
+    uint8_t channels = lFlac->flac.frame.header.channels;
+
+    if(lFlac->output == LUAMINIFLAC_OUTPUT_MONO && channels > 1) return 1;
+    if(lFlac->output == LUAMINIFLAC_OUTPUT_STEREO && channels > 2) return 2;
+    return 0;
+}
+
+/* points out at the channels to hand back for the frame that was
+ * just decoded, mixing them down into mixbuf (two channels, stride
+ * samples apart) when output_mix says so. selected channels the
+ * frame doesn't have are left out. returns the number of channels.
+ * Lua isn't touched, so the async worker can use this too */
+static uint8_t
+luaminiflac_select_output(luaminiflac_t* lFlac, int32_t* mixbuf, uint32_t stride, int32_t** out) {
+    uint8_t channels = lFlac->flac.frame.header.channels;
+    uint8_t n = luaminiflac_output_mix(lFlac);
+    uint8_t c = 0;
+
+    if(n > 0) {
+        out[0] = mixbuf;
+        out[1] = &mixbuf[stride];
+        luaminiflac_mix(out,n,lFlac->samples,channels,lFlac->flac.frame.header.block_size);
+        return n;
+    }
+
+    switch(lFlac->output) {
+        case LUAMINIFLAC_OUTPUT_SELECT: {
+            for(c=0;c<lFlac->output_count;c++) {
+                if(lFlac->output_select[c] < channels) {
+                    out[n++] = lFlac->samples[lFlac->output_select[c]];
+                }
+            }
+            return n;
+        }
+        case LUAMINIFLAC_OUTPUT_STEREO: {
+            if(channels != 1) break;
+            out[0] = lFlac->samples[0];
+            out[1] = lFlac->samples[0];
+            return 2;
+        }
+        default: break;
+    }
+
+    for(c=0;c<channels;c++) out[c] = lFlac->samples[c];
+    return channels;
+}
+
+/* select_output, with the mix buffer grown as needed */
+static uint8_t
+luaminiflac_output_channels(lua_State* L, int idx, luaminiflac_t* lFlac, int32_t** out) {
+    if(luaminiflac_output_mix(lFlac) > 0) {
+        luaminiflac_expand_mixbuf(L,idx,lFlac,lFlac->flac.frame.header.block_size);
+    }
+    return luaminiflac_select_output(lFlac,lFlac->mixbuf,lFlac->mix_capacity,out);
+}
+
+static void
+luaminiflac_output_error(lua_State* L, int idx, const char* name, const char* msg) {
+    if(name == NULL) luaL_argerror(L,idx,msg);
+    luaL_error(L,"bad %s (%s)",name,msg);
+}
+
+/* reads a channel spec: nil or "all" for every channel, "mono" or
+ * "stereo" for a downmix, or an array of 1-based channel numbers.
+ * errors name argument idx, or name when it isn't NULL. the decoder
+ * is only changed once the whole spec is valid */
+static void
+luaminiflac_check_output(lua_State* L, int idx, const char* name, luaminiflac_t* lFlac) {
+    uint8_t select[8];
+    lua_Integer c = 0;
+    size_t i = 0;
+    size_t len = 0;
+    const char* mode = NULL;
+
+    if(lua_istable(L,idx)) {
+        len = lua_rawlen(L,idx);
+        if(len < 1 || len > 8) {
+            luaminiflac_output_error(L,idx,name,"expected 1 to 8 channels");
+        }
+        for(i=1;i<=len;i++) {
+            lua_rawgeti(L,idx,(int)i);
+            c = lua_isnumber(L,-1) ? lua_tointeger(L,-1) : 0;
+            if(c < 1 || c > 8) {
+                luaminiflac_output_error(L,idx,name,"channels are numbered 1 to 8");
+            }
+            select[i-1] = (uint8_t)(c - 1);
+            lua_pop(L,1);
+        }
+        memcpy(lFlac->output_select,select,len);
+        lFlac->output = LUAMINIFLAC_OUTPUT_SELECT;
+        lFlac->output_count = (uint8_t)len;
+        return;
+    }
+    if(lua_isnoneornil(L,idx)) {
+        lFlac->output = LUAMINIFLAC_OUTPUT_ALL;
+        lFlac->output_count = 0;
+        return;
+    }
+    if(lua_type(L,idx) == LUA_TSTRING) {
+        mode = lua_tostring(L,idx);
+        for(i=0;luaminiflac_output_modes[i] != NULL;i++) {
+            if(strcmp(mode,luaminiflac_output_modes[i]) == 0) {
+                lFlac->output = (uint8_t)i;
+                lFlac->output_count = 0;
+                return;
+            }
+        }
+    }
+    luaminiflac_output_error(L,idx,name,"expected \"all\", \"mono\", \"stereo\" or an array of channels");
+}
+
+static int
+luaminiflac_miniflac_set_channels(lua_State *L) {
+    /*
+     * set_channels(spec)
+     * picks the channels decode, decode_pcm, decode_many and frames
+     * return. spec is nil or "all", "mono" or "stereo" to mix down,
+     * or an array of 1-based channel numbers. MD5 checking still
+     * covers every channel */
+    luaminiflac_t *lFlac = NULL;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_check_output(L,2,NULL,lFlac);
+    return 0;
+}
+
+/* }}} */
+
+static void
+luaminiflac_push_frame_samples(lua_State* L, int32_t** samples, uint8_t channels, uint32_t block_size) {
+    uint8_t channel = 0;
+    uint32_t sample = 0;
+
+    lua_createtable(L,channels,0);
+    while(channel<channels) {
+        sample = 0;
+        lua_createtable(L,block_size,0);
+        while(sample < block_size) {
+            lua_pushinteger(L,samples[channel][sample]);
+            lua_rawseti(L,-2,++sample);
+        }
+        lua_rawseti(L,-2,++channel);
+    }
+}
+
+/* fills in the samples table on top of the stack, reusing the
+ * channel tables already in it. entries past the end of a shorter
+ * frame are cleared, so # is always the block size */
+static void
+luaminiflac_set_frame_samples(lua_State* L, int32_t** samples, uint8_t channels, uint32_t block_size) {
+    uint8_t channel = 0;
+    uint32_t sample = 0;
+    size_t len = 0;
+
+    for(channel=0;channel<channels;channel++) {
+        lua_rawgeti(L,-1,channel + 1);
+        if(!lua_istable(L,-1)) {
+            lua_pop(L,1);
+            lua_createtable(L,block_size,0);
+            lua_pushvalue(L,-1);
+            lua_rawseti(L,-3,channel + 1);
+        }
+        sample = 0;
+        while(sample < block_size) {
+            lua_pushinteger(L,samples[channel][sample]);
+            lua_rawseti(L,-2,++sample);
+        }
+        for(len = lua_rawlen(L,-1);len > block_size;len--) {
+            lua_pushnil(L);
+            lua_rawseti(L,-2,(int)len);
+        }
+        lua_pop(L,1);
+    }
+    for(len = lua_rawlen(L,-1);len > channels;len--) {
+        lua_pushnil(L);
+        lua_rawseti(L,-2,(int)len);
+    }
+}
+
+
+static void
+luaminiflac_push_frame_pcm(lua_State* L, luaminiflac_t* lFlac, int32_t** samples, uint8_t channels, LUAMINIFLAC_PCM format) {
+    uint32_t len = (uint32_t)channels
+      * (uint32_t)lFlac->flac.frame.header.block_size
+      * (uint32_t)luaminiflac_pcm_sizes[format];
+
+    luaminiflac_expand_buffer(L,1,lFlac,len);
+    luaminiflac_pack_pcm(lFlac->buffer,samples,channels,
+      lFlac->flac.frame.header.block_size,
+      lFlac->flac.frame.header.bps,
+      format);
+    lua_pushlstring(L,(const char*)lFlac->buffer,len);
+}
+
+static void
+luaminiflac_push_frame_footer(lua_State* L, luaminiflac_t* lFlac) {
+    lua_newtable(L);
+    lua_pushinteger(L,lFlac->flac.frame.crc16);
     lua_setfield(L,-2,"crc16");
 }
 
+/* pushes the frame table, with either a table of samples, or
+ * for a format >= 0, a string of packed PCM */
 static void
-luaminiflac_push_frame(lua_State* L, luaminiflac_t* lFlac) {
+luaminiflac_push_frame(lua_State* L, luaminiflac_t* lFlac, int format) {
+    int32_t* out[8];
+    uint8_t channels = 0;
+
+    channels = luaminiflac_output_channels(L,1,lFlac,out);
     lua_newtable(L);
 
     lua_pushstring(L,"frame");
@@ -1154,11 +2248,20 @@ luaminiflac_push_frame(lua_State* L, luaminiflac_t* lFlac) {
 
     lua_newtable(L);
 
-    luaminiflac_push_frame_header(L,lFlac);
+    luaminiflac_push_frame_header(L,&lFlac->flac.frame.header);
     lua_setfield(L,-2,"header");
 
-    luaminiflac_push_frame_samples(L,lFlac);
-    lua_setfield(L,-2,"samples");
+    if(format < 0) {
+        luaminiflac_push_frame_samples(L,out,channels,lFlac->flac.frame.header.block_size);
+        lua_setfield(L,-2,"samples");
+    } else {
+        luaminiflac_push_frame_pcm(L,lFlac,out,channels,(LUAMINIFLAC_PCM)format);
+        lua_setfield(L,-2,"pcm");
+        lua_pushstring(L,luaminiflac_pcm_formats[format]);
+        lua_setfield(L,-2,"format");
+    }
+    lua_pushinteger(L,channels);
+    lua_setfield(L,-2,"channels");
 
     luaminiflac_push_frame_footer(L,lFlac);
     lua_setfield(L,-2,"footer");
@@ -1166,8 +2269,462 @@ luaminiflac_push_frame(lua_State* L, luaminiflac_t* lFlac) {
     lua_setfield(L,-2,"frame");
 }
 
+/* samplebuf {{{ */
 static int
-luaminiflac_miniflac_t(lua_State *L) {
+luaminiflac_samplebuf(lua_State *L) {
+    lua_Integer channels = 0;
+    lua_Integer capacity = 0;
+    lua_Integer c = 0;
+    luaminiflac_samplebuf_t *buf = NULL;
+
+    channels = luaL_checkinteger(L,1);
+    capacity = luaL_optinteger(L,2,65535);
+    luaL_argcheck(L,channels >= 1 && channels <= 8,1,"channels must be between 1 and 8");
+    luaL_argcheck(L,capacity >= 1 && capacity <= 65535,2,"capacity must be between 1 and 65535");
+
+    buf = lua_newuserdata(L,sizeof(luaminiflac_samplebuf_t) + sizeof(int32_t) * (size_t)channels * (size_t)capacity);
+    if(buf == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    buf->channels = (uint32_t)channels;
+    buf->capacity = (uint32_t)capacity;
+    buf->frame_channels = 0;
+    buf->length = 0;
+    buf->sample_rate = 0;
+    buf->bps = 0;
+    for(c=0;c<8;c++) {
+        buf->samples[c] = c < channels ? &buf->data[c * capacity] : NULL;
+    }
+
+    luaL_setmetatable(L,luaminiflac_samplebuf_mt);
+    return 1;
+}
+
+/* buf[i] indexes the samples of the last frame in interleaved order,
+ * strings look up methods */
+static int
+luaminiflac_samplebuf__index(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = NULL;
+    lua_Integer i = 0;
+
+    buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    if(lua_type(L,2) != LUA_TNUMBER) {
+        lua_pushvalue(L,2);
+        lua_rawget(L,lua_upvalueindex(1));
+        return 1;
+    }
+
+    i = lua_tointeger(L,2) - 1;
+    if(i < 0 || buf->frame_channels == 0 || (uint64_t)i >= (uint64_t)buf->length * buf->frame_channels) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L,buf->samples[i % buf->frame_channels][i / buf->frame_channels]);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf__len(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,(lua_Integer)buf->length * buf->frame_channels);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf_get(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = NULL;
+    lua_Integer channel = 0;
+    lua_Integer i = 0;
+
+    buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    channel = luaL_checkinteger(L,2);
+    i = luaL_checkinteger(L,3);
+    if(channel < 1 || channel > buf->frame_channels || i < 1 || i > buf->length) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L,buf->samples[channel-1][i-1]);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf_channels(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,buf->frame_channels);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf_length(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,buf->length);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf_capacity(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,buf->capacity);
+    lua_pushinteger(L,buf->channels);
+    return 2;
+}
+
+static int
+luaminiflac_samplebuf_bps(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,buf->bps);
+    return 1;
+}
+
+static int
+luaminiflac_samplebuf_sample_rate(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    lua_pushinteger(L,buf->sample_rate);
+    return 1;
+}
+
+/* returns a lightuserdata pointing at the int32_t samples
+ * of a channel (default 1), for use with ffi.cast. channels
+ * are stored one after another, capacity samples apart */
+static int
+luaminiflac_samplebuf_pointer(lua_State *L) {
+    luaminiflac_samplebuf_t *buf = NULL;
+    lua_Integer channel = 0;
+
+    buf = luaL_checkudata(L,1,luaminiflac_samplebuf_mt);
+    channel = luaL_optinteger(L,2,1);
+    luaL_argcheck(L,channel >= 1 && channel <= buf->channels,2,"invalid channel");
+    lua_pushlightuserdata(L,buf->samples[channel-1]);
+    return 1;
+}
+
+static const struct luaL_Reg luaminiflac_samplebuf_methods[] = {
+    { "get",         luaminiflac_samplebuf_get         },
+    { "channels",    luaminiflac_samplebuf_channels    },
+    { "length",      luaminiflac_samplebuf_length      },
+    { "capacity",    luaminiflac_samplebuf_capacity    },
+    { "bps",         luaminiflac_samplebuf_bps         },
+    { "sample_rate", luaminiflac_samplebuf_sample_rate },
+    { "pointer",     luaminiflac_samplebuf_pointer     },
+    { NULL,          NULL                              },
+};
+/* }}} */
+
+/* frame index {{{ */
+
+/*
+ * serialized index layout, all values little-endian:
+ *   "mfIX", uint32 count,
+ *   then per frame: uint64 offset, uint64 sample, uint16 block_size - 1
+ */
+#define LUAMINIFLAC_INDEX_MAGIC "mfIX"
+#define LUAMINIFLAC_INDEX_HEADER_SIZE 8
+#define LUAMINIFLAC_INDEX_ENTRY_SIZE 18
+
+static luaminiflac_index_t*
+luaminiflac_index_new(lua_State* L) {
+    luaminiflac_index_t* idx = NULL;
+
+    idx = lua_newuserdata(L,sizeof(luaminiflac_index_t));
+    if(idx == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    idx->entries = NULL;
+    idx->count = 0;
+    idx->capacity = 0;
+    idx->block_size = 0;
+    luaL_setmetatable(L,luaminiflac_index_mt);
+
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+    return idx;
+}
+
+/* makes room for at least count entries, the entries are stored
+ * in a userdata in the index's uservalue table */
+static void
+luaminiflac_index_reserve(lua_State* L, int i, luaminiflac_index_t* idx, size_t count) {
+    size_t cap = 0;
+    luaminiflac_index_entry_t* entries = NULL;
+
+    if(count <= idx->capacity) return;
+
+    cap = idx->capacity ? idx->capacity : 256;
+    while(cap < count) {
+        cap *= 2;
+    }
+
+    lua_getuservalue(L,i);
+    entries = lua_newuserdata(L,sizeof(luaminiflac_index_entry_t) * cap);
+    if(entries == NULL) {
+        luaL_error(L,"out of memory");
+        return;
+    }
+    if(idx->count > 0) {
+        memcpy(entries,idx->entries,sizeof(luaminiflac_index_entry_t) * idx->count);
+    }
+    idx->entries = entries;
+    idx->capacity = cap;
+    lua_setfield(L,-2,"entries");
+    lua_pop(L,1);
+}
+
+/* returns an error message, or NULL if the entry was appended */
+static const char*
+luaminiflac_index_append(lua_State* L, int i, luaminiflac_index_t* idx, uint64_t offset, uint64_t sample, uint32_t block_size) {
+    luaminiflac_index_entry_t* prev = NULL;
+
+    if(block_size == 0 || block_size > 65536) return "invalid block size";
+
+    if(idx->count > 0) {
+        prev = &idx->entries[idx->count - 1];
+        if(offset <= prev->offset || sample < prev->sample + prev->block_size) {
+            return "frames must be added in order";
+        }
+        /* the previous frame is no longer the last one, so
+         * it has to match for direct lookups to work */
+        if(prev->block_size != idx->block_size || sample != prev->sample + prev->block_size) {
+            idx->block_size = 0;
+        }
+    } else {
+        idx->block_size = sample == 0 ? block_size : 0;
+    }
+
+    luaminiflac_index_reserve(L,i,idx,idx->count + 1);
+    idx->entries[idx->count].offset = offset;
+    idx->entries[idx->count].sample = sample;
+    idx->entries[idx->count].block_size = block_size;
+    idx->count++;
+    return NULL;
+}
+
+/* returns the entry holding a sample, or NULL */
+static const luaminiflac_index_entry_t*
+luaminiflac_index_lookup(const luaminiflac_index_t* idx, uint64_t sample) {
+    const luaminiflac_index_entry_t* e = NULL;
+    size_t lo = 0;
+    size_t hi = 0;
+    size_t mid = 0;
+
+    if(idx->count == 0) return NULL;
+
+    if(idx->block_size) {
+        lo = (size_t)(sample / idx->block_size);
+        if(lo >= idx->count) lo = idx->count - 1;
+    } else {
+        /* last entry starting at or before the sample */
+        hi = idx->count;
+        while(hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+            if(idx->entries[mid].sample <= sample) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+    }
+
+    e = &idx->entries[lo];
+    if(sample < e->sample || sample >= e->sample + e->block_size) return NULL;
+    return e;
+}
+
+static void
+luaminiflac_index_push_entry(lua_State* L, const luaminiflac_index_entry_t* e) {
+    luaminiflac_pushuint64(L,e->offset);
+    luaminiflac_pushuint64(L,e->sample);
+    lua_pushinteger(L,(lua_Integer)e->block_size);
+}
+
+static int
+luaminiflac_index(lua_State *L) {
+    luaminiflac_index_new(L);
+    return 1;
+}
+
+static int
+luaminiflac_index_add(lua_State *L) {
+    /* idx:add(offset, sample, block_size) */
+    luaminiflac_index_t* idx = NULL;
+    uint64_t offset = 0;
+    uint64_t sample = 0;
+    lua_Integer block_size = 0;
+    const char* err = NULL;
+
+    idx = luaL_checkudata(L,1,luaminiflac_index_mt);
+    offset = luaminiflac_checkuint64(L,2,"invalid offset");
+    sample = luaminiflac_checkuint64(L,3,"invalid sample");
+    block_size = luaL_checkinteger(L,4);
+    luaL_argcheck(L,block_size > 0 && block_size <= 65536,4,"invalid block size");
+
+    err = luaminiflac_index_append(L,1,idx,offset,sample,(uint32_t)block_size);
+    if(err != NULL) {
+        return luaL_error(L,"%s",err);
+    }
+    return 0;
+}
+
+static int
+luaminiflac_index_find(lua_State *L) {
+    /* returns offset, first sample, block_size of the frame
+     * holding a sample, or nil */
+    luaminiflac_index_t* idx = NULL;
+    const luaminiflac_index_entry_t* e = NULL;
+
+    idx = luaL_checkudata(L,1,luaminiflac_index_mt);
+    luaL_checkany(L,2);
+
+    if((lua_type(L,2) == LUA_TNUMBER && lua_tonumber(L,2) < 0)
+      || (e = luaminiflac_index_lookup(idx,luaminiflac_touint64(L,2))) == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaminiflac_index_push_entry(L,e);
+    return 3;
+}
+
+static int
+luaminiflac_index_get(lua_State *L) {
+    /* returns offset, sample, block_size of the i-th frame */
+    luaminiflac_index_t* idx = NULL;
+    lua_Integer i = 0;
+
+    idx = luaL_checkudata(L,1,luaminiflac_index_mt);
+    i = luaL_checkinteger(L,2);
+    if(i < 1 || (size_t)i > idx->count) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaminiflac_index_push_entry(L,&idx->entries[i-1]);
+    return 3;
+}
+
+static int
+luaminiflac_index__len(lua_State *L) {
+    luaminiflac_index_t* idx = luaL_checkudata(L,1,luaminiflac_index_mt);
+    lua_pushinteger(L,(lua_Integer)idx->count);
+    return 1;
+}
+
+static void
+luaminiflac_pack_le(uint8_t* out, uint64_t val, unsigned int bytes) {
+    unsigned int i = 0;
+    for(i=0;i<bytes;i++) {
+        out[i] = (uint8_t)(val >> (8 * i));
+    }
+}
+
+static uint64_t
+luaminiflac_unpack_le(const uint8_t* in, unsigned int bytes) {
+    uint64_t val = 0;
+    unsigned int i = bytes;
+    while(i--) {
+        val = (val << 8) | in[i];
+    }
+    return val;
+}
+
+static int
+luaminiflac_index_serialize(lua_State *L) {
+    luaminiflac_index_t* idx = NULL;
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+    luaL_Buffer b;
+#endif
+    uint8_t* out = NULL;
+    uint8_t* p = NULL;
+    size_t len = 0;
+    size_t i = 0;
+
+    idx = luaL_checkudata(L,1,luaminiflac_index_mt);
+    if(idx->count > 0xFFFFFFFF) {
+        return luaL_error(L,"index too large");
+    }
+
+    len = LUAMINIFLAC_INDEX_HEADER_SIZE + LUAMINIFLAC_INDEX_ENTRY_SIZE * idx->count;
+    /* the entries are packed straight into the string buffer. 5.1
+     * has no sized buffers, so there they go through a userdata */
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+    out = (uint8_t*)luaL_buffinitsize(L,&b,len);
+#else
+    out = lua_newuserdata(L,len);
+    if(out == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+#endif
+
+    memcpy(out,LUAMINIFLAC_INDEX_MAGIC,4);
+    luaminiflac_pack_le(&out[4],idx->count,4);
+    p = &out[LUAMINIFLAC_INDEX_HEADER_SIZE];
+    for(i=0;i<idx->count;i++) {
+        luaminiflac_pack_le(&p[0],idx->entries[i].offset,8);
+        luaminiflac_pack_le(&p[8],idx->entries[i].sample,8);
+        luaminiflac_pack_le(&p[16],idx->entries[i].block_size - 1,2);
+        p += LUAMINIFLAC_INDEX_ENTRY_SIZE;
+    }
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 502
+    luaL_pushresultsize(&b,len);
+#else
+    lua_pushlstring(L,(const char*)out,len);
+#endif
+    return 1;
+}
+
+static int
+luaminiflac_index_load(lua_State *L) {
+    /* returns an index, or nil and an error message */
+    luaminiflac_index_t* idx = NULL;
+    const uint8_t* blob = NULL;
+    const uint8_t* p = NULL;
+    const char* err = NULL;
+    size_t len = 0;
+    size_t count = 0;
+    size_t i = 0;
+
+    blob = (const uint8_t*)luaL_checklstring(L,1,&len);
+    if(len < LUAMINIFLAC_INDEX_HEADER_SIZE || memcmp(blob,LUAMINIFLAC_INDEX_MAGIC,4) != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"not a serialized index");
+        return 2;
+    }
+    count = (size_t)luaminiflac_unpack_le(&blob[4],4);
+    if((len - LUAMINIFLAC_INDEX_HEADER_SIZE) / LUAMINIFLAC_INDEX_ENTRY_SIZE != count
+      || (len - LUAMINIFLAC_INDEX_HEADER_SIZE) % LUAMINIFLAC_INDEX_ENTRY_SIZE != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"truncated index");
+        return 2;
+    }
+
+    idx = luaminiflac_index_new(L);
+    luaminiflac_index_reserve(L,-1,idx,count);
+    p = &blob[LUAMINIFLAC_INDEX_HEADER_SIZE];
+    for(i=0;i<count;i++) {
+        err = luaminiflac_index_append(L,-1,idx,
+          luaminiflac_unpack_le(&p[0],8),
+          luaminiflac_unpack_le(&p[8],8),
+          (uint32_t)luaminiflac_unpack_le(&p[16],2) + 1);
+        if(err != NULL) {
+            lua_pushnil(L);
+            lua_pushstring(L,err);
+            return 2;
+        }
+        p += LUAMINIFLAC_INDEX_ENTRY_SIZE;
+    }
+    return 1;
+}
+
+static const struct luaL_Reg luaminiflac_index_methods[] = {
+    { "add",       luaminiflac_index_add       },
+    { "find",      luaminiflac_index_find      },
+    { "get",       luaminiflac_index_get       },
+    { "serialize", luaminiflac_index_serialize },
+    { NULL,        NULL                        },
+};
+/* }}} */
+
+static int
+luaminiflac_new(lua_State *L, int metadata_only) {
     lua_Integer container = 0;
     unsigned int c = 0;
     luaminiflac_t *lFlac = NULL;
@@ -1187,11 +2744,35 @@ luaminiflac_miniflac_t(lua_State *L) {
     }
 
     for(c=0;c<8;c++) {
-        lFlac->samples[c] = &lFlac->samplebuf[c * 65535];
+        lFlac->samples[c] = NULL;
     }
+    lFlac->samplebuf = NULL;
+    lFlac->sample_capacity = 0;
+    lFlac->sample_channels = 0;
+    lFlac->metadata_only = (uint8_t)metadata_only;
+    lFlac->meta_step = 0;
 
     lFlac->buffer = NULL;
     lFlac->buffer_len = 0;
+    lFlac->input = NULL;
+    lFlac->input_len = 0;
+    lFlac->input_pos = 0;
+    lFlac->input_cap = 0;
+    lFlac->fd = -1;
+    lFlac->fd_eof = 0;
+    lFlac->fd_owned = 0;
+    lFlac->map = NULL;
+    lFlac->map_len = 0;
+    lFlac->container = (MINIFLAC_CONTAINER)container;
+
+    luaminiflac_md5_init(&lFlac->md5);
+    lFlac->md5_enabled = 0;
+    lFlac->md5_expected_set = 0;
+    memset(&lFlac->stats,0,sizeof(luaminiflac_stats_t));
+    lFlac->output = LUAMINIFLAC_OUTPUT_ALL;
+    lFlac->output_count = 0;
+    lFlac->mixbuf = NULL;
+    lFlac->mix_capacity = 0;
 
     miniflac_init(&lFlac->flac,(MINIFLAC_CONTAINER)container);
     luaL_setmetatable(L,luaminiflac_mt);
@@ -1204,329 +2785,3252 @@ luaminiflac_miniflac_t(lua_State *L) {
     return 1;
 }
 
-static int
-luaminiflac_miniflac_init(lua_State *L) {
-    luaminiflac_t *lFlac = NULL;
-    lua_Integer container = 0;
+static int
+luaminiflac_miniflac_t(lua_State *L) {
+    return luaminiflac_new(L,0);
+}
+
+/* a decoder for reading metadata, it never allocates sample
+ * storage so decode and decode_pcm are unavailable */
+static int
+luaminiflac_miniflac_metadata_t(lua_State *L) {
+    return luaminiflac_new(L,1);
+}
+
+static int
+luaminiflac_open(lua_State *L) {
+    /*
+     * open(path, container)
+     * returns a miniflac_t that reads the file itself, pass nil
+     * in place of data to any method. on failure returns nil
+     * and an error message */
+    luaminiflac_t *lFlac = NULL;
+    const char* path = NULL;
+    int fd = -1;
+
+    path = luaL_checkstring(L,1);
+    lua_settop(L,2);
+    lua_pushvalue(L,1); /* keeps path alive */
+    lua_remove(L,1);
+    luaminiflac_new(L,0);
+    lFlac = lua_touserdata(L,-1);
+
+    fd = luaminiflac_open_fd(path);
+    if(fd < 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: %s",path,strerror(errno));
+        return 2;
+    }
+    lFlac->fd = fd;
+    lFlac->fd_owned = 1;
+    return 1;
+}
+
+static int
+luaminiflac_from_fd(lua_State *L) {
+    /*
+     * from_fd(fd, container)
+     * like open, but reads from an already open file descriptor,
+     * which is left open when the decoder is closed */
+    luaminiflac_t *lFlac = NULL;
+    lua_Integer fd = -1;
+
+    fd = luaL_checkinteger(L,1);
+    luaL_argcheck(L,fd >= 0,1,"invalid file descriptor");
+    lua_settop(L,2);
+    lua_remove(L,1);
+    luaminiflac_new(L,0);
+    lFlac = lua_touserdata(L,-1);
+    lFlac->fd = (int)fd;
+    return 1;
+}
+
+static int
+luaminiflac_miniflac_close(lua_State *L) {
+    /* closes a file opened with miniflac.open, also used for __gc */
+    luaminiflac_t *lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+
+    if(lFlac->fd >= 0 && lFlac->fd_owned) {
+        luaminiflac_close_fd(lFlac->fd);
+    }
+    lFlac->fd = -1;
+    lFlac->fd_owned = 0;
+
+    if(lFlac->map != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(lFlac->map);
+#else
+        munmap(lFlac->map,lFlac->map_len);
+#endif
+        lFlac->map = NULL;
+        lFlac->map_len = 0;
+        lFlac->input = NULL;
+        lFlac->input_len = 0;
+        lFlac->input_pos = 0;
+    }
+    return 0;
+}
+
+static int
+luaminiflac_miniflac_stats(lua_State *L) {
+    /*
+     * stats(reset)
+     * returns a table of the decoder's counters, and resets them
+     * afterwards if reset is true. times (in seconds) are only
+     * included when built with LUAMINIFLAC_TIMING */
+    luaminiflac_t *lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    const luaminiflac_stats_t* st = &lFlac->stats;
+
+    lua_newtable(L);
+    lua_pushinteger(L,(lua_Integer)st->bytes);
+    lua_setfield(L,-2,"bytes");
+    lua_pushinteger(L,(lua_Integer)st->frames);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,(lua_Integer)st->samples);
+    lua_setfield(L,-2,"samples");
+    lua_pushinteger(L,(lua_Integer)st->sync_retries);
+    lua_setfield(L,-2,"sync_retries");
+    lua_pushinteger(L,(lua_Integer)st->resyncs);
+    lua_setfield(L,-2,"resyncs");
+    lua_pushinteger(L,(lua_Integer)st->skipped);
+    lua_setfield(L,-2,"skipped_bytes");
+    lua_pushinteger(L,(lua_Integer)st->crc8_errors);
+    lua_setfield(L,-2,"crc8_errors");
+    lua_pushinteger(L,(lua_Integer)st->crc16_errors);
+    lua_setfield(L,-2,"crc16_errors");
+    lua_pushinteger(L,(lua_Integer)st->errors);
+    lua_setfield(L,-2,"errors");
+#ifdef LUAMINIFLAC_TIMING
+    lua_pushnumber(L,(lua_Number)st->sync_time / 1e9);
+    lua_setfield(L,-2,"sync_time");
+    lua_pushnumber(L,(lua_Number)st->decode_time / 1e9);
+    lua_setfield(L,-2,"decode_time");
+    lua_pushnumber(L,(lua_Number)st->marshal_time / 1e9);
+    lua_setfield(L,-2,"marshal_time");
+    lua_pushnumber(L,(lua_Number)st->copy_time / 1e9);
+    lua_setfield(L,-2,"copy_time");
+#endif
+
+    if(lua_toboolean(L,2)) {
+        memset(&lFlac->stats,0,sizeof(luaminiflac_stats_t));
+    }
+    return 1;
+}
+
+/* memory-mapped input {{{ */
+
+static const char* const luaminiflac_advice[] = {
+    "normal",
+    "sequential",
+    "random",
+    "willneed",
+    NULL,
+};
+
+/* applies an access pattern hint to part of a mapped file,
+ * rounded out to page boundaries. a no-op where unsupported */
+static void
+luaminiflac_madvise(luaminiflac_t* lFlac, size_t offset, size_t len, int advice) {
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+    static const int advices[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = 0;
+
+    if(lFlac->map == NULL || offset >= lFlac->map_len) return;
+    if(len > lFlac->map_len - offset) len = lFlac->map_len - offset;
+    start = offset - (offset % page);
+    madvise(&lFlac->map[start],len + (offset - start),advices[advice]);
+#else
+    (void)lFlac;
+    (void)offset;
+    (void)len;
+    (void)advice;
+#endif
+}
+
+static int
+luaminiflac_mmap(lua_State *L) {
+    /*
+     * mmap(path, container)
+     * returns a miniflac_t that decodes straight from the mapped
+     * file, pass nil in place of data to any method. on failure
+     * returns nil and an error message */
+    luaminiflac_t *lFlac = NULL;
+    const char* path = NULL;
+    uint8_t* map = NULL;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    LARGE_INTEGER size;
+#else
+    int fd = -1;
+    struct stat st;
+#endif
+
+    path = luaL_checkstring(L,1);
+    lua_settop(L,2);
+    lua_pushvalue(L,1); /* keeps path alive */
+    lua_remove(L,1);
+    luaminiflac_new(L,0);
+    lFlac = lua_touserdata(L,-1);
+
+#ifdef _WIN32
+    file = CreateFileA(path,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+    if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file,&size)) {
+        if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: unable to open file",path);
+        return 2;
+    }
+    /* a 32-bit process can't map a file of 4 GiB or more */
+    if((unsigned long long)size.QuadPart > (unsigned long long)(size_t)-1) {
+        CloseHandle(file);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: file too large",path);
+        return 2;
+    }
+    len = (size_t)size.QuadPart;
+    if(len > 0) {
+        mapping = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+        if(mapping != NULL) {
+            map = MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    if(len > 0 && map == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: unable to map file",path);
+        return 2;
+    }
+#else
+    fd = open(path,O_RDONLY);
+    if(fd < 0 || fstat(fd,&st) != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: %s",path,strerror(errno));
+        if(fd >= 0) close(fd);
+        return 2;
+    }
+    if((unsigned long long)st.st_size > (unsigned long long)(size_t)-1) {
+        close(fd);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: file too large",path);
+        return 2;
+    }
+    len = (size_t)st.st_size;
+    if(len > 0) {
+        map = mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
+        if(map == MAP_FAILED) {
+            lua_pushnil(L);
+            lua_pushfstring(L,"%s: %s",path,strerror(errno));
+            close(fd);
+            return 2;
+        }
+    }
+    /* the mapping stays valid after the file is closed */
+    close(fd);
+#endif
+
+    lFlac->map = map;
+    lFlac->map_len = len;
+    lFlac->input = map;
+    lFlac->input_len = len;
+    lFlac->input_pos = 0;
+    luaminiflac_madvise(lFlac,0,len,1);
+    return 1;
+}
+
+/* frames can leave their sample rate and bps to STREAMINFO, so after
+ * a seek it's run through the reset decoder again. a native stream's
+ * STREAMINFO goes in marked as the last metadata block, and for Ogg
+ * the first page, which holds it, is passed in */
+static void
+luaminiflac_replay_streaminfo(luaminiflac_t* lFlac) {
+    uint8_t header[42];
+    const uint8_t* data = lFlac->map;
+    size_t avail = lFlac->map_len;
+    size_t tag = 0;
+    size_t len = 0;
+    size_t pos = 0;
+    uint32_t used = 0;
+    uint8_t i = 0;
+
+    /* skip ID3v2 tags, the size is 28 bits, 7 to a byte, and leaves
+     * out the 10 byte header and the footer */
+    while(avail >= 10 && memcmp(data,"ID3",3) == 0) {
+        tag = 10 + (((size_t)(data[6] & 0x7F) << 21) | ((size_t)(data[7] & 0x7F) << 14)
+          | ((size_t)(data[8] & 0x7F) << 7) | (size_t)(data[9] & 0x7F));
+        if(data[5] & 0x10) tag += 10;
+        if(tag > avail) return;
+        data += tag;
+        avail -= tag;
+    }
+
+    if(avail >= 42 && memcmp(data,"fLaC",4) == 0
+      && (data[4] & 0x7F) == 0 && data[5] == 0 && data[6] == 0 && data[7] == 34) {
+        memcpy(header,data,42);
+        header[4] |= 0x80;
+        data = header;
+        len = 42;
+    } else if(avail >= 27 && memcmp(data,"OggS",4) == 0
+      && avail >= 27 + (size_t)data[26]) {
+        len = 27 + (size_t)data[26];
+        for(i=0;i<data[26];i++) len += data[27 + i];
+        if(len > avail) return;
+    } else {
+        return;
+    }
+
+    while(pos < len) {
+        if(miniflac_sync(&lFlac->flac,&data[pos],(uint32_t)(len - pos),&used) != MINIFLAC_OK) break;
+        pos += used;
+    }
+}
+
+static int
+luaminiflac_miniflac_seek(lua_State *L) {
+    /*
+     * seek(offset)
+     * moves a memory-mapped decoder to a 0-based byte offset, which
+     * should be the start of a frame (or Ogg page), and resets the
+     * decoder. STREAMINFO is replayed, but MD5 checking starts over
+     * like after :init(). the pages after the offset are requested
+     * ahead of time */
+    luaminiflac_t *lFlac = NULL;
+    uint64_t offset = 0;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    /* offsets from an index may be uint64_t userdata */
+    offset = luaminiflac_checkuint64(L,2,"offset out of range");
+    if(lFlac->map == NULL) {
+        return luaL_error(L,"seek is only available on memory-mapped decoders");
+    }
+    luaL_argcheck(L,offset <= (uint64_t)lFlac->map_len,2,"offset out of range");
+
+    miniflac_init(&lFlac->flac,lFlac->container);
+    lFlac->meta_step = 0;
+    luaminiflac_md5_init(&lFlac->md5);
+    lFlac->md5_expected_set = 0;
+    luaminiflac_replay_streaminfo(lFlac);
+    lFlac->input_pos = (size_t)offset;
+    luaminiflac_madvise(lFlac,(size_t)offset,LUAMINIFLAC_READ_SIZE * 4,3);
+    return 0;
+}
+
+static int
+luaminiflac_miniflac_tell(lua_State *L) {
+    /* returns the 0-based byte offset of the next unread byte of a
+     * memory-mapped or file-backed decoder. for a file this is where
+     * the file is, less whatever is buffered but not yet decoded. on
+     * failure (like a pipe) returns nil and an error message */
+    luaminiflac_t *lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    long long pos = 0;
+
+    if(lFlac->map != NULL) {
+        lua_pushinteger(L,(lua_Integer)lFlac->input_pos);
+        return 1;
+    }
+    if(lFlac->fd < 0) {
+        return luaL_error(L,"tell is only available on memory-mapped or file-backed decoders");
+    }
+    pos = (long long)luaminiflac_seek_fd(lFlac->fd,0,SEEK_CUR);
+    if(pos < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L,strerror(errno));
+        return 2;
+    }
+    lua_pushinteger(L,(lua_Integer)(pos - (long long)(lFlac->input_len - lFlac->input_pos)));
+    return 1;
+}
+
+static int
+luaminiflac_miniflac_advise(lua_State *L) {
+    /*
+     * advise(pattern)
+     * tells the kernel how a memory-mapped file will be read, one of
+     * "sequential" (the default), "random" (for lots of seeking) or
+     * "normal" */
+    luaminiflac_t *lFlac = NULL;
+    int advice = 0;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    advice = luaL_checkoption(L,2,NULL,luaminiflac_advice);
+    luaminiflac_madvise(lFlac,0,lFlac->map_len,advice);
+    return 0;
+}
+
+/* }}} */
+
+static int
+luaminiflac_miniflac_init(lua_State *L) {
+    /*
+     * init(container)
+     * resets the decoder for a new stream. input buffered by :feed()
+     * is dropped, a file-backed decoder seeks back over it instead
+     * (or keeps it, on a pipe), and a memory-mapped one keeps its
+     * position (see :seek()) */
+    luaminiflac_t *lFlac = NULL;
+    lua_Integer container = 0;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    container = luaL_optinteger(L,2,(lua_Integer)MINIFLAC_CONTAINER_UNKNOWN);
+    switch(container) {
+        case MINIFLAC_CONTAINER_UNKNOWN: break;
+        case MINIFLAC_CONTAINER_NATIVE: break;
+        case MINIFLAC_CONTAINER_OGG: break;
+        default:
+            return luaL_error(L,"invalid container type");
+    }
+    miniflac_init(&lFlac->flac,(MINIFLAC_CONTAINER)container);
+    lFlac->container = (MINIFLAC_CONTAINER)container;
+    lFlac->meta_step = 0;
+    luaminiflac_md5_init(&lFlac->md5);
+    lFlac->md5_expected_set = 0;
+    /* a mapped file is the input, use :seek() to move around it */
+    if(lFlac->map != NULL) return 0;
+    /* buffered input belongs to the old stream position, when
+     * reading from a file put the file back where decoding left off.
+     * pipes and sockets can't be put back, so there the unread bytes
+     * stay buffered and are the first ones the new stream sees */
+    if(lFlac->fd >= 0 && lFlac->input_len > lFlac->input_pos) {
+        if(luaminiflac_seek_fd(lFlac->fd,-(long)(lFlac->input_len - lFlac->input_pos),SEEK_CUR) < 0) {
+            return 0;
+        }
+        lFlac->fd_eof = 0;
+    }
+    lFlac->input_len = 0;
+    lFlac->input_pos = 0;
+    return 0;
+}
+
+/* miniflac_sync, but when stopped at a STREAMINFO block its md5 is read
+ * first, so :verify() has it whichever call ends up skipping the block */
+static MINIFLAC_RESULT
+luaminiflac_sync_streaminfo(luaminiflac_t* lFlac, const uint8_t* data, uint32_t len, uint32_t* used) {
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+    uint32_t u = 0;
+    uint32_t md5_len = 0;
+
+    *used = 0;
+    if(!lFlac->md5_expected_set && lFlac->flac.state == MINIFLAC_METADATA
+      && lFlac->flac.metadata.header.type == MINIFLAC_METADATA_STREAMINFO) {
+        r = miniflac_streaminfo_md5_data(&lFlac->flac,data,len,used,lFlac->md5_expected,16,&md5_len);
+        if(r == MINIFLAC_CONTINUE) return r;
+        /* an md5 already read some other way is left to miniflac_sync */
+        lFlac->md5_expected_set = r == MINIFLAC_OK && md5_len == 16;
+    }
+    r = miniflac_sync(&lFlac->flac,&data[*used],len - *used,&u);
+    *used += u;
+    return r;
+}
+
+/* syncs up to the header of the next audio frame, skipping
+ * metadata, so the frame size is known before decoding */
+static MINIFLAC_RESULT
+luaminiflac_sync_frame(luaminiflac_t* lFlac, const uint8_t* data, uint32_t len, uint32_t* used) {
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+    uint32_t u = 0;
+    LUAMINIFLAC_TIMER(t)
+
+    LUAMINIFLAC_TIMER_START(t);
+    *used = 0;
+    lFlac->meta_step = 0;
+    while(!(lFlac->flac.state == MINIFLAC_FRAME && lFlac->flac.frame.state != MINIFLAC_FRAME_HEADER)) {
+        luaminiflac_count_resync(lFlac,&data[*used],len - *used);
+        r = luaminiflac_sync_streaminfo(lFlac,&data[*used],len - *used,&u);
+        *used += u;
+        if(r != MINIFLAC_OK) break;
+    }
+    LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.sync_time);
+    return r;
+}
+
+static int
+luaminiflac_miniflac_feed(lua_State *L) {
+    /* returns the number of bytes buffered */
+    luaminiflac_t *lFlac = NULL;
+    const char* str = NULL;
+    size_t len = 0;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    str   = luaL_checklstring(L,2,&len);
+    if(lFlac->map != NULL) {
+        return luaL_error(L,"can't feed a memory-mapped decoder");
+    }
+
+    luaminiflac_feed(L,1,lFlac,str,len);
+
+    lua_pushinteger(L,(lua_Integer)(lFlac->input_len - lFlac->input_pos));
+    return 1;
+}
+
+static int
+luaminiflac_sync(lua_State *L, int at) {
+    /*
+     * returns result, err, remain
+     * on MINIFLAC_CONTINUE, result = false, rem is likely 0 bytes
+     * on error, result = nil and err is set
+     * err is only set on error, nil otherwise
+     * for sync_at, remain is the position of the next unprocessed byte */
+    luaminiflac_t *lFlac = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used = 0;
+    MINIFLAC_RESULT r;
+    LUAMINIFLAC_TIMER(t)
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_checkinput(L,2,lFlac,at,&in);
+    lFlac->meta_step = 0;
+
+    LUAMINIFLAC_TIMER_START(t);
+    do {
+        luaminiflac_count_resync(lFlac,luaminiflac_input_data(&in),luaminiflac_input_len(&in));
+        r = luaminiflac_sync_streaminfo(lFlac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used);
+    } while(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&used));
+    LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.sync_time);
+
+    switch(r) {
+        case MINIFLAC_CONTINUE: {
+            lFlac->stats.sync_retries++;
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        case MINIFLAC_OK: {
+            luaminiflac_push_header(L,lFlac);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        default: break;
+    }
+    lua_pushnil(L);
+    luaminiflac_push_error(L,lFlac,r);
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+static int
+luaminiflac_miniflac_sync(lua_State *L) {
+    return luaminiflac_sync(L,0);
+}
+
+static int
+luaminiflac_miniflac_sync_at(lua_State *L) {
+    return luaminiflac_sync(L,1);
+}
+
+static int
+luaminiflac_decode(lua_State *L, int at, int pcm) {
+    /*
+     * returns result, err, rem
+     * on MINIFLAC_CONTINUE, result = false, rem is likely 0 bytes
+     * on error, result = nil and err is set
+     * err is only set on error, nil otherwise
+     * result is a multidimensional tables of samples, or for
+     * decode_pcm a string of interleaved PCM in the requested format
+     * for decode_at, rem is the position of the next unprocessed byte */
+    luaminiflac_t *lFlac = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used = 0;
+    uint32_t      u = 0;
+    int      format = -1;
+    int         idx = 0;
+    const uint8_t* data = NULL;
+    uint32_t    len = 0;
+    MINIFLAC_RESULT r;
+    LUAMINIFLAC_TIMER(t)
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    idx   = luaminiflac_checkinput(L,2,lFlac,at,&in);
+    if(pcm) {
+        format = luaL_checkoption(L,idx,"s16",luaminiflac_pcm_formats);
+    }
+    if(lFlac->metadata_only) {
+        return luaL_error(L,"decoder is metadata-only");
+    }
+
+    do {
+        data = luaminiflac_input_data(&in);
+        len  = luaminiflac_input_len(&in);
+
+        r = luaminiflac_sync_frame(lFlac,data,len,&used);
+        if(r == MINIFLAC_OK) {
+            luaminiflac_expand_samples(L,1,lFlac,
+              lFlac->flac.frame.header.channels,
+              lFlac->flac.frame.header.block_size);
+            LUAMINIFLAC_TIMER_START(t);
+            r = miniflac_decode(&lFlac->flac,&data[used],len - used,&u,lFlac->samples);
+            LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.decode_time);
+            used += u;
+        }
+    } while(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&used));
+
+    switch(r) {
+        case MINIFLAC_CONTINUE: {
+            lFlac->stats.sync_retries++;
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        case MINIFLAC_OK: {
+            luaminiflac_count_frame(lFlac);
+            if(lFlac->md5_enabled) {
+                luaminiflac_md5_frame(&lFlac->md5,lFlac->samples,
+                  lFlac->flac.frame.header.channels,
+                  lFlac->flac.frame.header.block_size,
+                  lFlac->flac.frame.header.bps);
+            }
+            LUAMINIFLAC_TIMER_START(t);
+            luaminiflac_push_frame(L,lFlac,format);
+            LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.marshal_time);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        default: break;
+    }
+    lua_pushnil(L);
+    luaminiflac_push_error(L,lFlac,r);
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+static int
+luaminiflac_miniflac_decode(lua_State *L) {
+    return luaminiflac_decode(L,0,0);
+}
+
+static int
+luaminiflac_miniflac_decode_at(lua_State *L) {
+    return luaminiflac_decode(L,1,0);
+}
+
+static int
+luaminiflac_miniflac_decode_pcm(lua_State *L) {
+    return luaminiflac_decode(L,0,1);
+}
+
+static int
+luaminiflac_miniflac_decode_pcm_at(lua_State *L) {
+    return luaminiflac_decode(L,1,1);
+}
+
+static int
+luaminiflac_decode_many(lua_State *L, int at) {
+    /*
+     * decode_many(data, limit, format)
+     * returns result, err, rem
+     * decodes frames until the input runs out or the limit is hit. limit
+     * is a maximum number of frames, or a table with frames and/or
+     * samples (per channel) limits. result is a table with pcm (every
+     * frame packed together, like decode_pcm) and frames (an array of
+     * each frame's block size). decoding stops early if the channels,
+     * bps or sample rate change, so all of pcm has the same layout.
+     * if nothing was decoded result is false (more data is needed) or
+     * nil (an error). an error after some frames were decoded returns
+     * both the frames and the error */
+    luaminiflac_t *lFlac = NULL;
+    luaminiflac_input_t in;
+    luaL_Buffer b;
+    const miniflac_frame_header_t* h = NULL;
+    const uint8_t* data = NULL;
+    uint32_t    len = 0;
+    uint32_t   used = 0;
+    uint32_t      u = 0;
+    uint32_t frame_len = 0;
+    int         idx = 0;
+    int      format = LUAMINIFLAC_PCM_S16;
+    int  frames_idx = 0;
+    lua_Integer max_frames = 0x7FFFFFFF;
+    lua_Integer max_samples = 0x7FFFFFFF;
+    lua_Integer count = 0;
+    lua_Integer total = 0;
+    uint8_t channels = 0;
+    uint8_t out_channels = 0;
+    int32_t* out[8];
+    uint8_t bps = 0;
+    uint32_t sample_rate = 0;
+    MINIFLAC_RESULT r = MINIFLAC_CONTINUE;
+    LUAMINIFLAC_TIMER(t)
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    idx   = luaminiflac_checkinput(L,2,lFlac,at,&in);
+    if(lua_istable(L,idx)) {
+        lua_getfield(L,idx,"frames");
+        max_frames = luaL_optinteger(L,-1,max_frames);
+        lua_getfield(L,idx,"samples");
+        max_samples = luaL_optinteger(L,-1,max_samples);
+        lua_pop(L,2);
+    } else {
+        max_frames = luaL_optinteger(L,idx,max_frames);
+    }
+    luaL_argcheck(L,max_frames >= 1 && max_samples >= 1,idx,"limit must be at least 1");
+    format = luaL_checkoption(L,idx+1,"s16",luaminiflac_pcm_formats);
+    if(lFlac->metadata_only) {
+        return luaL_error(L,"decoder is metadata-only");
+    }
+
+    data = luaminiflac_input_data(&in);
+    len  = luaminiflac_input_len(&in);
+    h = &lFlac->flac.frame.header;
+
+    lua_newtable(L);
+    frames_idx = lua_gettop(L);
+    luaL_buffinit(L,&b);
+
+    while(count < max_frames) {
+        r = luaminiflac_sync_frame(lFlac,&data[used],len - used,&u);
+        used += u;
+        if(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&used)) {
+            data = luaminiflac_input_data(&in);
+            len  = luaminiflac_input_len(&in);
+            continue;
+        }
+        if(r != MINIFLAC_OK) break;
+
+        /* the header stays parsed, the next call picks up with this frame */
+        if(count > 0
+          && (h->channels != channels || h->bps != bps || h->sample_rate != sample_rate
+            || total + h->block_size > max_samples)) {
+            break;
+        }
+
+        luaminiflac_expand_samples(L,1,lFlac,h->channels,h->block_size);
+        LUAMINIFLAC_TIMER_START(t);
+        r = miniflac_decode(&lFlac->flac,&data[used],len - used,&u,lFlac->samples);
+        LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.decode_time);
+        used += u;
+        if(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&used)) {
+            data = luaminiflac_input_data(&in);
+            len  = luaminiflac_input_len(&in);
+            continue;
+        }
+        if(r != MINIFLAC_OK) break;
+
+        luaminiflac_count_frame(lFlac);
+        if(lFlac->md5_enabled) {
+            luaminiflac_md5_frame(&lFlac->md5,lFlac->samples,h->channels,h->block_size,h->bps);
+        }
+
+        LUAMINIFLAC_TIMER_START(t);
+        out_channels = luaminiflac_output_channels(L,1,lFlac,out);
+        frame_len = (uint32_t)out_channels * h->block_size * luaminiflac_pcm_sizes[format];
+        luaminiflac_expand_buffer(L,1,lFlac,frame_len);
+        luaminiflac_pack_pcm(lFlac->buffer,out,out_channels,h->block_size,h->bps,(LUAMINIFLAC_PCM)format);
+        luaL_addlstring(&b,(const char*)lFlac->buffer,frame_len);
+        LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.marshal_time);
+
+        lua_pushinteger(L,h->block_size);
+        lua_rawseti(L,frames_idx,(int)++count);
+
+        channels = h->channels;
+        bps = h->bps;
+        sample_rate = h->sample_rate;
+        total += h->block_size;
+    }
+
+    luaL_pushresult(&b);
+
+    if(count == 0) {
+        lua_settop(L,frames_idx - 1);
+        if(r == MINIFLAC_CONTINUE) {
+            lFlac->stats.sync_retries++;
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+        } else {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+        }
+        luaminiflac_push_remain(L,&in,used);
+        return 3;
+    }
+
+    lua_newtable(L);
+    lua_insert(L,-2);
+    lua_setfield(L,-2,"pcm");
+    lua_pushvalue(L,frames_idx);
+    lua_setfield(L,-2,"frames");
+    lua_pushstring(L,luaminiflac_pcm_formats[format]);
+    lua_setfield(L,-2,"format");
+    lua_pushinteger(L,total);
+    lua_setfield(L,-2,"samples");
+    lua_pushinteger(L,out_channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,bps);
+    lua_setfield(L,-2,"bps");
+    lua_pushinteger(L,sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+
+    if(r == MINIFLAC_OK || r == MINIFLAC_CONTINUE) {
+        lua_pushnil(L);
+    } else {
+        luaminiflac_push_error(L,lFlac,r);
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+static int
+luaminiflac_miniflac_decode_many(lua_State *L) {
+    return luaminiflac_decode_many(L,0);
+}
+
+static int
+luaminiflac_miniflac_decode_many_at(lua_State *L) {
+    return luaminiflac_decode_many(L,1);
+}
+
+static int
+luaminiflac_decode_into(lua_State *L, int at) {
+    /*
+     * returns result, err, rem
+     * like decode, but the samples are written into a samplebuf
+     * and the samplebuf is returned as the result. if a frame
+     * is only partially decoded, the next call must use the same
+     * samplebuf. */
+    luaminiflac_t *lFlac = NULL;
+    luaminiflac_samplebuf_t *buf = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used = 0;
+    uint32_t      u = 0;
+    int         idx = 0;
+    const uint8_t* data = NULL;
+    uint32_t    len = 0;
+    MINIFLAC_RESULT r;
+    LUAMINIFLAC_TIMER(t)
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    idx   = luaminiflac_checkinput(L,2,lFlac,at,&in);
+    buf   = luaL_checkudata(L,idx,luaminiflac_samplebuf_mt);
+
+    do {
+        data = luaminiflac_input_data(&in);
+        len  = luaminiflac_input_len(&in);
+
+        r = luaminiflac_sync_frame(lFlac,data,len,&used);
+        if(r == MINIFLAC_OK) {
+            if(lFlac->flac.frame.header.channels > buf->channels
+              || lFlac->flac.frame.header.block_size > buf->capacity) {
+                /* the header has been parsed, so return what's left of the
+                 * input. calling again with a larger samplebuf decodes the frame */
+                lua_pushnil(L);
+                lua_pushinteger(L,LUAMINIFLAC_SAMPLEBUF_TOO_SMALL);
+                luaminiflac_push_remain(L,&in,used);
+                return 3;
+            }
+            LUAMINIFLAC_TIMER_START(t);
+            r = miniflac_decode(&lFlac->flac,&data[used],len - used,&u,buf->samples);
+            LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.decode_time);
+            used += u;
+        }
+    } while(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&used));
+
+    switch(r) {
+        case MINIFLAC_CONTINUE: {
+            lFlac->stats.sync_retries++;
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        case MINIFLAC_OK: {
+            luaminiflac_count_frame(lFlac);
+            buf->frame_channels = lFlac->flac.frame.header.channels;
+            buf->length = lFlac->flac.frame.header.block_size;
+            buf->sample_rate = lFlac->flac.frame.header.sample_rate;
+            buf->bps = lFlac->flac.frame.header.bps;
+            if(lFlac->md5_enabled) {
+                luaminiflac_md5_frame(&lFlac->md5,buf->samples,buf->frame_channels,buf->length,buf->bps);
+            }
+            lua_pushvalue(L,idx);
+            lua_pushnil(L);
+            luaminiflac_push_remain(L,&in,used);
+            return 3;
+        }
+        default: break;
+    }
+    lua_pushnil(L);
+    luaminiflac_push_error(L,lFlac,r);
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+static int
+luaminiflac_miniflac_decode_into(lua_State *L) {
+    return luaminiflac_decode_into(L,0);
+}
+
+static int
+luaminiflac_miniflac_decode_into_at(lua_State *L) {
+    return luaminiflac_decode_into(L,1);
+}
+
+/* frame iterator {{{ */
+
+/* gets more input for the iterator, from the reader function at
+ * index 2 or the decoder's own file. returns 0 at the end of the
+ * stream, after which the reader isn't called again */
+static int
+luaminiflac_frames_read(lua_State* L, luaminiflac_t* lFlac) {
+    const char* str = NULL;
+    size_t len = 0;
+
+    if(lua_isnil(L,2)) return luaminiflac_refill(L,1,lFlac) > 0;
+
+    do {
+        lua_pushvalue(L,2);
+        lua_pushinteger(L,LUAMINIFLAC_READ_SIZE);
+        lua_call(L,1,1);
+        if(lua_isnil(L,-1)) {
+            lua_pushnil(L);
+            lua_replace(L,lua_upvalueindex(2));
+            return 0;
+        }
+        str = lua_tolstring(L,-1,&len);
+        if(str == NULL) {
+            return luaL_error(L,"reader returned a %s, expected a string",luaL_typename(L,-1));
+        }
+        luaminiflac_feed(L,1,lFlac,str,len);
+        lua_pop(L,1);
+    } while(len == 0);
+    return 1;
+}
+
+static int
+luaminiflac_frames_next(lua_State *L) {
+    luaminiflac_t *lFlac = NULL;
+    const uint8_t* data = NULL;
+    int32_t* out[8];
+    uint8_t channels = 0;
+    size_t remain = 0;
+    uint32_t len = 0;
+    uint32_t used = 0;
+    uint32_t u = 0;
+    MINIFLAC_RESULT r = MINIFLAC_CONTINUE;
+    LUAMINIFLAC_TIMER(t)
+
+    lua_settop(L,0);
+    lua_pushvalue(L,lua_upvalueindex(1)); /* decoder */
+    lua_pushvalue(L,lua_upvalueindex(2)); /* reader, or nil */
+    lua_pushvalue(L,lua_upvalueindex(3)); /* frame */
+    lFlac = lua_touserdata(L,1);
+
+    for(;;) {
+        data = &lFlac->input[lFlac->input_pos];
+        remain = lFlac->input_len - lFlac->input_pos;
+        len = remain > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)remain;
+        used = 0;
+
+        r = luaminiflac_sync_frame(lFlac,data,len,&used);
+        if(r == MINIFLAC_OK) {
+            luaminiflac_expand_samples(L,1,lFlac,
+              lFlac->flac.frame.header.channels,
+              lFlac->flac.frame.header.block_size);
+            LUAMINIFLAC_TIMER_START(t);
+            r = miniflac_decode(&lFlac->flac,&data[used],len - used,&u,lFlac->samples);
+            LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.decode_time);
+            used += u;
+        }
+        lFlac->input_pos += used;
+        lFlac->stats.bytes += used;
+
+        if(r == MINIFLAC_OK) break;
+        if(r != MINIFLAC_CONTINUE) {
+            /* the same code decode would return as err, with its name */
+            luaminiflac_count_error(lFlac,r);
+            return luaL_error(L,"decode failed: %s (%d)",luaminiflac_result_name(r),(int)r);
+        }
+        lFlac->stats.sync_retries++;
+        if(!luaminiflac_frames_read(L,lFlac)) {
+            if(luaminiflac_truncated(lFlac)) {
+                return luaL_error(L,"decode failed: truncated frame");
+            }
+            return 0;
+        }
+    }
+
+    luaminiflac_count_frame(lFlac);
+    if(lFlac->md5_enabled) {
+        luaminiflac_md5_frame(&lFlac->md5,lFlac->samples,
+          lFlac->flac.frame.header.channels,
+          lFlac->flac.frame.header.block_size,
+          lFlac->flac.frame.header.bps);
+    }
+
+    LUAMINIFLAC_TIMER_START(t);
+    channels = luaminiflac_output_channels(L,1,lFlac,out);
+    lua_getfield(L,3,"header");
+    luaminiflac_set_frame_header(L,&lFlac->flac.frame.header);
+    lua_getfield(L,3,"samples");
+    luaminiflac_set_frame_samples(L,out,channels,lFlac->flac.frame.header.block_size);
+    lua_getfield(L,3,"footer");
+    lua_pushinteger(L,lFlac->flac.frame.crc16);
+    lua_setfield(L,-2,"crc16");
+    lua_pop(L,3);
+    lua_pushinteger(L,channels);
+    lua_setfield(L,3,"channels");
+    LUAMINIFLAC_TIMER_ADD(t,lFlac->stats.marshal_time);
+
+    return 1;
+}
+
+static int
+luaminiflac_frames(lua_State *L) {
+    /*
+     * frames(src, container, opts)
+     * returns an iterator over the audio frames of a stream, for
+     * a generic for. src is a function returning the next chunk of
+     * data, or nil at the end of the stream (it's passed a size, so
+     * f:read works), a string holding the whole stream, or a
+     * miniflac_t from open, from_fd or mmap. metadata is skipped and
+     * errors are raised, including a stream that ends partway through
+     * a frame. opts.channels is passed to set_channels.
+     * every step returns the same table, with the header, samples
+     * and footer overwritten, so copy anything kept past the next step */
+    luaminiflac_t *lFlac = NULL;
+    const char* str = NULL;
+    size_t len = 0;
+    int opts = 3;
+
+    lua_settop(L,3);
+    lFlac = luaL_testudata(L,1,luaminiflac_mt);
+    if(lFlac != NULL) {
+        if(lFlac->metadata_only) {
+            return luaL_argerror(L,1,"decoder is metadata-only");
+        }
+        lua_pushvalue(L,1);
+        lua_pushnil(L);
+    } else {
+        luaL_argcheck(L,lua_isfunction(L,1) || lua_type(L,1) == LUA_TSTRING,1,
+          "expected a function, string or miniflac_t");
+        lua_pushvalue(L,1);
+        lua_remove(L,1);
+        opts = 2;
+        luaminiflac_new(L,0); /* uses the container at 1 */
+        lFlac = lua_touserdata(L,-1);
+        if(lua_isfunction(L,3)) {
+            lua_pushvalue(L,3);
+        } else {
+            str = lua_tolstring(L,3,&len);
+            luaminiflac_feed(L,4,lFlac,str,len);
+            lua_pushnil(L);
+        }
+    }
+    /* a missing opts.channels keeps an earlier set_channels */
+    if(lua_istable(L,opts)) {
+        lua_getfield(L,opts,"channels");
+        if(!lua_isnil(L,-1)) {
+            luaminiflac_check_output(L,lua_gettop(L),"opts.channels",lFlac);
+        }
+        lua_pop(L,1);
+    }
+
+    lua_createtable(L,0,3);
+    lua_newtable(L);
+    lua_setfield(L,-2,"header");
+    lua_newtable(L);
+    lua_setfield(L,-2,"samples");
+    lua_newtable(L);
+    lua_setfield(L,-2,"footer");
+
+    lua_pushcclosure(L,luaminiflac_frames_next,3);
+    return 1;
+}
+
+/* }}} */
+
+static int
+luaminiflac_miniflac_enable_md5(lua_State *L) {
+    /* turns hashing of decoded audio on (default) or off,
+     * either way the hash starts over */
+    luaminiflac_t *lFlac = NULL;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    lFlac->md5_enabled = (uint8_t)(lua_isnoneornil(L,2) || lua_toboolean(L,2));
+    luaminiflac_md5_init(&lFlac->md5);
+    return 0;
+}
+
+static int
+luaminiflac_miniflac_md5(lua_State *L) {
+    /* returns the 16-byte MD5 of the audio decoded so far,
+     * or nil if hashing isn't enabled */
+    luaminiflac_t *lFlac = NULL;
+    uint8_t digest[16];
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    if(!lFlac->md5_enabled) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaminiflac_md5_digest(&lFlac->md5,digest);
+    lua_pushlstring(L,(const char*)digest,16);
+    return 1;
+}
+
+static int
+luaminiflac_miniflac_verify(lua_State *L) {
+    /*
+     * returns match, md5, expected
+     * expected defaults to the md5 from STREAMINFO, kept by whichever
+     * call parsed or skipped the block. match is nil if there's nothing to compare
+     * against, or the expected md5 is all zeros (meaning unset) */
+    static const uint8_t zeros[16] = { 0 };
+    luaminiflac_t *lFlac = NULL;
+    const char* expected = NULL;
+    size_t len = 0;
+    uint8_t digest[16];
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    expected = luaL_optlstring(L,2,NULL,&len);
+    if(!lFlac->md5_enabled) {
+        return luaL_error(L,"md5 is not enabled, call enable_md5 before decoding");
+    }
+    if(expected == NULL && lFlac->md5_expected_set) {
+        expected = (const char*)lFlac->md5_expected;
+        len = 16;
+    }
+    luaL_argcheck(L,expected == NULL || len == 16,2,"expected md5 must be 16 bytes");
+
+    luaminiflac_md5_digest(&lFlac->md5,digest);
+    if(expected == NULL || memcmp(expected,zeros,16) == 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushboolean(L,memcmp(expected,digest,16) == 0);
+    }
+    lua_pushlstring(L,(const char*)digest,16);
+    if(expected == NULL) {
+        lua_pushnil(L);
+    } else {
+        lua_pushlstring(L,expected,16);
+    }
+    return 3;
+}
+
+/* closure for getting a uint8_t */
+static int
+luaminiflac_read_uint8(lua_State *L) {
+    luaminiflac_t *lFlac      = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used           = 0;
+    uint8_t     val           = 0;
+    luaminiflac_uint8_func f = NULL;
+    MINIFLAC_RESULT r;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    f = (luaminiflac_uint8_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    r = f(&lFlac->flac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used,&val);
+
+    /* treat METADATA_END like CONTINUE, the coroutine interface tracks that we've
+     * read the right number of comments / bytes / whatever */
+    switch(r) {
+        case MINIFLAC_METADATA_END: /* fall-through */
+        case MINIFLAC_CONTINUE: {
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            break;
+        }
+        case MINIFLAC_OK: {
+            lua_pushinteger(L,val);
+            lua_pushnil(L);
+            break;
+        }
+        default: {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+            break;
+        }
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+/* closure for getting a uint16_t */
+static int
+luaminiflac_read_uint16(lua_State *L) {
+    luaminiflac_t *lFlac      = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used           = 0;
+    uint16_t    val           = 0;
+    luaminiflac_uint16_func f = NULL;
+    MINIFLAC_RESULT r;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    f = (luaminiflac_uint16_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    r = f(&lFlac->flac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used,&val);
+
+    switch(r) {
+        case MINIFLAC_METADATA_END: /* fall-through */
+        case MINIFLAC_CONTINUE: {
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            break;
+        }
+        case MINIFLAC_OK: {
+            lua_pushinteger(L,val);
+            lua_pushnil(L);
+            break;
+        }
+        default: {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+            break;
+        }
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+/* closure for getting a uint32_t */
+static int
+luaminiflac_read_uint32(lua_State *L) {
+    luaminiflac_t *lFlac      = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used           = 0;
+    uint32_t    val           = 0;
+    luaminiflac_uint32_func f = NULL;
+    MINIFLAC_RESULT r;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    f = (luaminiflac_uint32_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    r = f(&lFlac->flac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used,&val);
+
+    switch(r) {
+        case MINIFLAC_METADATA_END: /* fall-through */
+        case MINIFLAC_CONTINUE: {
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            break;
+        }
+        case MINIFLAC_OK: {
+            lua_pushinteger(L,val);
+            lua_pushnil(L);
+            break;
+        }
+        default: {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+            break;
+        }
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+/* closure for getting a uint64_t */
+static int
+luaminiflac_read_uint64(lua_State *L) {
+    luaminiflac_t *lFlac      = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used           = 0;
+    uint64_t    val           = 0;
+    luaminiflac_uint64_func f = NULL;
+    MINIFLAC_RESULT r;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    f = (luaminiflac_uint64_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    r = f(&lFlac->flac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used,&val);
+
+    switch(r) {
+        case MINIFLAC_METADATA_END: /* fall-through */
+        case MINIFLAC_CONTINUE: {
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            break;
+        }
+        case MINIFLAC_OK: {
+            luaminiflac_pushuint64(L,val);
+            lua_pushnil(L);
+            break;
+        }
+        default: {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+            break;
+        }
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+/* closure for getting a string */
+static int
+luaminiflac_read_str(lua_State *L) {
+    luaminiflac_t *lFlac   = NULL;
+    luaminiflac_input_t in;
+    uint32_t   used        = 0;
+    uint32_t   maxlen      = 0;
+    int        idx         = 0;
+    luaminiflac_str_func f = NULL;
+    MINIFLAC_RESULT r;
+
+    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
+    idx   = luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    maxlen = luaL_optinteger(L,idx,0);
+    f = (luaminiflac_str_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    luaminiflac_expand_buffer(L, 1, lFlac, maxlen);
+
+    r = f(&lFlac->flac,luaminiflac_input_data(&in),luaminiflac_input_len(&in),&used,lFlac->buffer,lFlac->buffer_len,&maxlen);
+
+    switch(r) {
+        case MINIFLAC_METADATA_END: /* fall-through */
+        case MINIFLAC_CONTINUE: {
+            lua_pushboolean(L,0);
+            lua_pushnil(L);
+            break;
+        }
+        case MINIFLAC_OK: {
+            /* keep the expected hash for :verify() */
+            if(f == (luaminiflac_str_func)miniflac_streaminfo_md5_data && maxlen == 16) {
+                memcpy(lFlac->md5_expected,lFlac->buffer,16);
+                lFlac->md5_expected_set = 1;
+            }
+            lua_pushlstring(L,(const char *)lFlac->buffer,maxlen);
+            lua_pushnil(L);
+            break;
+        }
+        default: {
+            lua_pushnil(L);
+            luaminiflac_push_error(L,lFlac,r);
+            break;
+        }
+    }
+    luaminiflac_push_remain(L,&in,used);
+    return 3;
+}
+
+/* frame header scanning {{{ */
+
+/*
+ * a standalone frame header parser, used to find frames
+ * in a stream without running it through miniflac_t.
+ * a sync code plus a valid CRC-8 is a good sign, but not proof,
+ * that there's a frame at a position. callers should check the
+ * header against STREAMINFO and neighbouring frames.
+ */
+
+typedef struct luaminiflac_frame_info_s {
+    uint8_t blocking_strategy;
+    uint32_t block_size;
+    uint32_t sample_rate;    /* 0 = from STREAMINFO */
+    uint8_t channel_assignment;
+    uint8_t channels;
+    uint8_t bps;             /* 0 = from STREAMINFO */
+    uint64_t number;         /* frame number, or sample number for variable blocksize */
+    uint8_t crc8;
+    uint32_t header_size;
+} luaminiflac_frame_info_t;
+
+static const uint32_t luaminiflac_sample_rates[] = {
+    0, 88200, 176400, 192000, 8000, 16000, 22050, 24000,
+    32000, 44100, 48000, 96000, 0, 0, 0, 0,
+};
+
+static const uint8_t luaminiflac_sample_sizes[] = {
+    0, 8, 12, 0, 16, 20, 24, 32,
+};
+
+static uint8_t
+luaminiflac_crc8(const uint8_t* data, size_t len) {
+    uint8_t crc = 0;
+    size_t i = 0;
+    unsigned int b = 0;
+
+    for(i=0;i<len;i++) {
+        crc ^= data[i];
+        for(b=0;b<8;b++) {
+            crc = (uint8_t)(crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+    }
+    return crc;
+}
+
+/* returns 1 if there's a valid frame header at data,
+ * 0 if not, -1 if more data is needed to tell */
+static int
+luaminiflac_parse_frame_header(const uint8_t* data, size_t len, luaminiflac_frame_info_t* info) {
+    size_t pos = 4;
+    unsigned int extra = 0;
+    unsigned int i = 0;
+    uint8_t bs_code = 0;
+    uint8_t sr_code = 0;
+    uint8_t ch_code = 0;
+    uint8_t ss_code = 0;
+
+    if(len > 0 && data[0] != 0xFF) return 0;
+    if(len > 1 && (data[1] & 0xFE) != 0xF8) return 0;
+    if(len < 4) return -1;
+
+    bs_code = data[2] >> 4;
+    sr_code = data[2] & 0x0F;
+    ch_code = data[3] >> 4;
+    ss_code = (data[3] >> 1) & 0x07;
+
+    if(bs_code == 0 || sr_code == 15 || ch_code > 10 || ss_code == 3 || (data[3] & 0x01)) return 0;
+
+    info->blocking_strategy = data[1] & 0x01;
+    info->channel_assignment = ch_code;
+    info->channels = ch_code < 8 ? ch_code + 1 : 2;
+    info->bps = luaminiflac_sample_sizes[ss_code];
+    info->sample_rate = luaminiflac_sample_rates[sr_code];
+
+    /* UTF-8 style coded frame or sample number */
+    if(len < pos + 1) return -1;
+    if(!(data[pos] & 0x80)) {
+        info->number = data[pos];
+        extra = 0;
+    } else if((data[pos] & 0xE0) == 0xC0) {
+        info->number = data[pos] & 0x1F;
+        extra = 1;
+    } else if((data[pos] & 0xF0) == 0xE0) {
+        info->number = data[pos] & 0x0F;
+        extra = 2;
+    } else if((data[pos] & 0xF8) == 0xF0) {
+        info->number = data[pos] & 0x07;
+        extra = 3;
+    } else if((data[pos] & 0xFC) == 0xF8) {
+        info->number = data[pos] & 0x03;
+        extra = 4;
+    } else if((data[pos] & 0xFE) == 0xFC) {
+        info->number = data[pos] & 0x01;
+        extra = 5;
+    } else if(data[pos] == 0xFE && info->blocking_strategy) {
+        info->number = 0;
+        extra = 6;
+    } else {
+        return 0;
+    }
+    pos++;
+    if(len < pos + extra) return -1;
+    for(i=0;i<extra;i++) {
+        if((data[pos] & 0xC0) != 0x80) return 0;
+        info->number = (info->number << 6) | (data[pos] & 0x3F);
+        pos++;
+    }
+
+    switch(bs_code) {
+        case 1: info->block_size = 192; break;
+        case 2: /* fall-through */
+        case 3: /* fall-through */
+        case 4: /* fall-through */
+        case 5: info->block_size = 576 << (bs_code - 2); break;
+        case 6: {
+            if(len < pos + 1) return -1;
+            info->block_size = (uint32_t)data[pos] + 1;
+            pos += 1;
+            break;
+        }
+        case 7: {
+            if(len < pos + 2) return -1;
+            info->block_size = (((uint32_t)data[pos] << 8) | data[pos+1]) + 1;
+            pos += 2;
+            break;
+        }
+        default: info->block_size = 256 << (bs_code - 8); break;
+    }
+
+    switch(sr_code) {
+        case 12: {
+            if(len < pos + 1) return -1;
+            info->sample_rate = (uint32_t)data[pos] * 1000;
+            pos += 1;
+            break;
+        }
+        case 13: {
+            if(len < pos + 2) return -1;
+            info->sample_rate = ((uint32_t)data[pos] << 8) | data[pos+1];
+            pos += 2;
+            break;
+        }
+        case 14: {
+            if(len < pos + 2) return -1;
+            info->sample_rate = (((uint32_t)data[pos] << 8) | data[pos+1]) * 10;
+            pos += 2;
+            break;
+        }
+        default: break;
+    }
+
+    if(len < pos + 1) return -1;
+    info->crc8 = data[pos];
+    if(luaminiflac_crc8(data,pos) != info->crc8) return 0;
+    info->header_size = (uint32_t)(pos + 1);
+    return 1;
+}
+
+/* searches for a frame header starting at pos. returns the offset
+ * of the header, or len if none was found. if a header may start
+ * too close to the end of the data to parse it, *partial is set
+ * to that offset, so the search can resume with more data */
+static size_t
+luaminiflac_find_frame_header(const uint8_t* data, size_t len, size_t pos, luaminiflac_frame_info_t* info, size_t* partial) {
+    const uint8_t* p = NULL;
+    int r = 0;
+
+    *partial = len;
+    while(pos < len) {
+        p = memchr(&data[pos],0xFF,len - pos);
+        if(p == NULL) break;
+        pos = (size_t)(p - data);
+        r = luaminiflac_parse_frame_header(&data[pos],len - pos,info);
+        if(r == 1) return pos;
+        if(r == -1) {
+            *partial = pos;
+            break;
+        }
+        pos++;
+    }
+    return len;
+}
+
+static void
+luaminiflac_push_frame_info(lua_State* L, const luaminiflac_frame_info_t* info) {
+    lua_newtable(L);
+
+    lua_pushinteger(L,info->blocking_strategy);
+    lua_setfield(L,-2,"blocking_strategy");
+    lua_pushinteger(L,info->block_size);
+    lua_setfield(L,-2,"block_size");
+    lua_pushinteger(L,info->sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+    switch(info->channel_assignment) {
+        case 8: lua_pushstring(L,"left_side_stereo"); break;
+        case 9: lua_pushstring(L,"right_side_stereo"); break;
+        case 10: lua_pushstring(L,"mid_side_stereo"); break;
+        default: lua_pushstring(L,"independent"); break;
+    }
+    lua_setfield(L,-2,"channel_assignment");
+    lua_pushinteger(L,info->channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,info->bps);
+    lua_setfield(L,-2,"bps");
+    if(info->blocking_strategy) { /* variable blocksize */
+        luaminiflac_pushuint64(L,info->number);
+        lua_setfield(L,-2,"sample_number");
+    } else {
+        lua_pushinteger(L,(lua_Integer)info->number);
+        lua_setfield(L,-2,"frame_number");
+    }
+    lua_pushinteger(L,info->crc8);
+    lua_setfield(L,-2,"crc8");
+    lua_pushinteger(L,info->header_size);
+    lua_setfield(L,-2,"header_size");
+}
+
+static int
+luaminiflac_find_frame(lua_State *L) {
+    /*
+     * find_frame(data, pos)
+     * returns the position of the next frame header at or after pos,
+     * and a table of the header fields (like the frame header from decode).
+     * if no header was found, returns nil and the position to resume
+     * searching from once more data is available */
+    luaminiflac_input_t in;
+    luaminiflac_frame_info_t info;
+    size_t offset = 0;
+    size_t partial = 0;
+
+    luaminiflac_checkinput(L,1,NULL,1,&in);
+
+    offset = luaminiflac_find_frame_header((const uint8_t*)in.str,in.len,in.pos,&info,&partial);
+    if(offset == in.len) {
+        lua_pushnil(L);
+        lua_pushinteger(L,(lua_Integer)partial + 1);
+        return 2;
+    }
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    luaminiflac_push_frame_info(L,&info);
+    return 2;
+}
+
+/* CRC-16 of a frame, polynomial 0x8005 */
+static const uint16_t luaminiflac_crc16_table[256] = {
+    0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006c, 0x8069, 0x0078, 0x807d, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805f, 0x005a, 0x804b, 0x004e, 0x0044, 0x8041,
+    0x80c3, 0x00c6, 0x00cc, 0x80c9, 0x00d8, 0x80dd, 0x80d7, 0x00d2,
+    0x00f0, 0x80f5, 0x80ff, 0x00fa, 0x80eb, 0x00ee, 0x00e4, 0x80e1,
+    0x00a0, 0x80a5, 0x80af, 0x00aa, 0x80bb, 0x00be, 0x00b4, 0x80b1,
+    0x8093, 0x0096, 0x009c, 0x8099, 0x0088, 0x808d, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018c, 0x8189, 0x0198, 0x819d, 0x8197, 0x0192,
+    0x01b0, 0x81b5, 0x81bf, 0x01ba, 0x81ab, 0x01ae, 0x01a4, 0x81a1,
+    0x01e0, 0x81e5, 0x81ef, 0x01ea, 0x81fb, 0x01fe, 0x01f4, 0x81f1,
+    0x81d3, 0x01d6, 0x01dc, 0x81d9, 0x01c8, 0x81cd, 0x81c7, 0x01c2,
+    0x0140, 0x8145, 0x814f, 0x014a, 0x815b, 0x015e, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017c, 0x8179, 0x0168, 0x816d, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012c, 0x8129, 0x0138, 0x813d, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811f, 0x011a, 0x810b, 0x010e, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030c, 0x8309, 0x0318, 0x831d, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833f, 0x033a, 0x832b, 0x032e, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836f, 0x036a, 0x837b, 0x037e, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035c, 0x8359, 0x0348, 0x834d, 0x8347, 0x0342,
+    0x03c0, 0x83c5, 0x83cf, 0x03ca, 0x83db, 0x03de, 0x03d4, 0x83d1,
+    0x83f3, 0x03f6, 0x03fc, 0x83f9, 0x03e8, 0x83ed, 0x83e7, 0x03e2,
+    0x83a3, 0x03a6, 0x03ac, 0x83a9, 0x03b8, 0x83bd, 0x83b7, 0x03b2,
+    0x0390, 0x8395, 0x839f, 0x039a, 0x838b, 0x038e, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828f, 0x028a, 0x829b, 0x029e, 0x0294, 0x8291,
+    0x82b3, 0x02b6, 0x02bc, 0x82b9, 0x02a8, 0x82ad, 0x82a7, 0x02a2,
+    0x82e3, 0x02e6, 0x02ec, 0x82e9, 0x02f8, 0x82fd, 0x82f7, 0x02f2,
+    0x02d0, 0x82d5, 0x82df, 0x02da, 0x82cb, 0x02ce, 0x02c4, 0x82c1,
+    0x8243, 0x0246, 0x024c, 0x8249, 0x0258, 0x825d, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827f, 0x027a, 0x826b, 0x026e, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822f, 0x022a, 0x823b, 0x023e, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021c, 0x8219, 0x0208, 0x820d, 0x8207, 0x0202,
+};
+
+/* finds the end of the frame with a header at data, without decoding
+ * it: the frame ends at the next frame header where the CRC-16 of
+ * everything before it, footer included, comes out to zero. when eof
+ * is set, the last frame ends at the last point where the CRC-16 comes
+ * out to zero, so trailing junk (an ID3v1 tag, padding) is left out.
+ * returns 1 and sets *size, -1 if more data is needed, 0 if there's
+ * no valid end */
+static int
+luaminiflac_frame_extent(const uint8_t* data, size_t len, const luaminiflac_frame_info_t* info, int eof, size_t* size) {
+    luaminiflac_frame_info_t next;
+    size_t min_size = info->header_size + 3; /* a subframe header and the footer */
+    size_t end = 0; /* the last place the frame could end */
+    size_t i = 0;
+    uint16_t crc = 0;
+    int r = 0;
+
+    for(i=0;i<len;i++) {
+        if(crc == 0 && i >= min_size) {
+            end = i;
+            if(data[i] == 0xFF) {
+                r = luaminiflac_parse_frame_header(&data[i],len - i,&next);
+                if(r == 1) {
+                    *size = i;
+                    return 1;
+                }
+                if(r == -1 && !eof) return -1;
+            }
+        }
+        crc = (uint16_t)((crc << 8) ^ luaminiflac_crc16_table[(crc >> 8) ^ data[i]]);
+    }
+
+    if(!eof) return -1;
+    if(crc == 0 && len >= min_size) end = len;
+    if(end == 0) return 0;
+    *size = end;
+    return 1;
+}
+
+/* finds the next frame at or after pos and its size. returns 1
+ * and sets *offset, -1 if more data is needed (with *offset set to
+ * resume from), 0 if a frame has no valid end */
+static int
+luaminiflac_skip_frame_header(const uint8_t* data, size_t len, size_t pos, int eof, luaminiflac_frame_info_t* info, size_t* offset, size_t* size) {
+    size_t partial = 0;
+    int r = 0;
+
+    *offset = luaminiflac_find_frame_header(data,len,pos,info,&partial);
+    if(*offset == len) {
+        *offset = partial;
+        return -1;
+    }
+    r = luaminiflac_frame_extent(&data[*offset],len - *offset,info,eof,size);
+    return r;
+}
+
+static void
+luaminiflac_push_frame_extent(lua_State* L, const luaminiflac_frame_info_t* info, size_t offset, size_t size) {
+    luaminiflac_push_frame_info(L,info);
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    lua_setfield(L,-2,"offset");
+    lua_pushinteger(L,(lua_Integer)size);
+    lua_setfield(L,-2,"size");
+}
+
+static int
+luaminiflac_skip_frame(lua_State *L) {
+    /*
+     * skip_frame(data, pos, eof)
+     * returns the position of the next frame at or after pos, and a
+     * table of its header fields with the frame's "size" in bytes.
+     * none of the frame is decoded. pass eof = true when data holds
+     * the end of the stream. if the end of the frame isn't in data,
+     * returns nil and the position to resume from, and if the frame
+     * is corrupt or truncated, nil, the position of the frame and an
+     * error message */
+    luaminiflac_input_t in;
+    luaminiflac_frame_info_t info;
+    size_t offset = 0;
+    size_t size = 0;
+    int r = 0;
+
+    luaminiflac_checkinput(L,1,NULL,1,&in);
+    r = luaminiflac_skip_frame_header((const uint8_t*)in.str,in.len,in.pos,lua_toboolean(L,3),&info,&offset,&size);
+    lua_pushnil(L);
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    if(r == -1) return 2;
+    if(r == 0) {
+        lua_pushliteral(L,"no valid frame end");
+        return 3;
+    }
+    lua_pop(L,2);
+
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    luaminiflac_push_frame_extent(L,&info,offset,size);
+    return 2;
+}
+
+static int
+luaminiflac_scan_frames(lua_State *L) {
+    /*
+     * scan_frames(data, pos, eof)
+     * like skip_frame, but finds every frame in data. returns an
+     * array of frame tables (each with an "offset" position), the
+     * position to resume from with more data, and an error message
+     * if a frame had no valid end */
+    luaminiflac_input_t in;
+    luaminiflac_frame_info_t info;
+    size_t pos = 0;
+    size_t offset = 0;
+    size_t size = 0;
+    lua_Integer n = 0;
+    int eof = 0;
+    int r = 0;
+
+    luaminiflac_checkinput(L,1,NULL,1,&in);
+    eof = lua_toboolean(L,3);
+    pos = in.pos;
+
+    lua_newtable(L);
+    while( (r = luaminiflac_skip_frame_header((const uint8_t*)in.str,in.len,pos,eof,&info,&offset,&size)) == 1) {
+        luaminiflac_push_frame_extent(L,&info,offset,size);
+        lua_rawseti(L,-2,++n);
+        pos = offset + size;
+    }
+
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    if(r == 0) {
+        lua_pushliteral(L,"no valid frame end");
+        return 3;
+    }
+    return 2;
+}
+
+/* }}} */
+
+/* ogg pages {{{ */
+
+typedef struct luaminiflac_ogg_page_s {
+    uint8_t flags;          /* 1 = continued, 2 = first page, 4 = last page */
+    uint64_t granule;
+    uint32_t serial;
+    uint32_t sequence;
+    uint32_t header_size;
+    uint32_t body_size;
+    uint32_t packets;       /* packets that end on this page */
+    uint32_t first_packet;  /* body offset of the first packet that begins on
+                             * this page, body_size if none does */
+} luaminiflac_ogg_page_t;
+
+/* CRC-32 of an Ogg page, polynomial 0x04c11db7, not reflected */
+static const uint32_t luaminiflac_ogg_crc_table[256] = {
+    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
+    0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+    0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+    0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+    0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
+    0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
+    0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+    0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+    0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+    0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
+    0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
+    0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+    0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+    0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+    0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
+    0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
+    0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+    0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+    0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+    0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
+    0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
+    0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+    0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+    0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+    0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
+    0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
+    0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+    0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+    0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+    0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
+    0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
+    0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+    0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+    0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+    0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
+    0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
+    0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+    0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+    0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+    0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
+    0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
+    0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+    0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+    0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+    0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
+    0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
+    0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+    0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+    0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+    0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
+    0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
+    0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+    0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+    0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4,
+};
+
+/* the page checksum is computed with the checksum field zeroed */
+static uint32_t
+luaminiflac_ogg_crc(const uint8_t* data, size_t len) {
+    uint32_t crc = 0;
+    size_t i = 0;
+
+    for(i=0;i<len;i++) {
+        crc = (crc << 8) ^ luaminiflac_ogg_crc_table[((crc >> 24) ^ (i - 22 < 4 ? 0 : data[i])) & 0xFF];
+    }
+    return crc;
+}
+
+/* returns 1 if there's a complete, valid page at data,
+ * 0 if not, -1 if more data is needed to tell */
+static int
+luaminiflac_parse_ogg_page(const uint8_t* data, size_t len, luaminiflac_ogg_page_t* page) {
+    uint32_t i = 0;
+    uint8_t segments = 0;
+    uint8_t ended = 0;
+
+    if(len < 4) return memcmp(data,"OggS",len) == 0 ? -1 : 0;
+    if(memcmp(data,"OggS",4) != 0) return 0;
+    if(len < 27) return -1;
+    if(data[4] != 0 || data[5] & 0xF8) return 0;
+
+    segments = data[26];
+    if(len < 27 + (size_t)segments) return -1;
+
+    page->flags = data[5];
+    page->granule = luaminiflac_unpack_le(&data[6],8);
+    page->serial = (uint32_t)luaminiflac_unpack_le(&data[14],4);
+    page->sequence = (uint32_t)luaminiflac_unpack_le(&data[18],4);
+    page->header_size = 27 + segments;
+    page->body_size = 0;
+    page->packets = 0;
+    page->first_packet = page->flags & 1 ? (uint32_t)-1 : 0;
+
+    for(i=0;i<segments;i++) {
+        page->body_size += data[27 + i];
+        if(data[27 + i] < 255) {
+            page->packets++;
+            if(!ended) {
+                ended = 1;
+                if(page->first_packet == (uint32_t)-1) page->first_packet = page->body_size;
+            }
+        }
+    }
+    if(page->first_packet > page->body_size) page->first_packet = page->body_size;
+
+    if(len < (size_t)page->header_size + page->body_size) return -1;
+    if(luaminiflac_ogg_crc(data,page->header_size + page->body_size) != (uint32_t)luaminiflac_unpack_le(&data[22],4)) return 0;
+    return 1;
+}
+
+/* searches for a page starting at pos. returns the offset of the
+ * page, or len if none was found, setting *partial like
+ * luaminiflac_find_frame_header */
+static size_t
+luaminiflac_find_ogg_page(const uint8_t* data, size_t len, size_t pos, luaminiflac_ogg_page_t* page, size_t* partial) {
+    const uint8_t* p = NULL;
+    int r = 0;
+
+    *partial = len;
+    while(pos < len) {
+        p = memchr(&data[pos],'O',len - pos);
+        if(p == NULL) break;
+        pos = (size_t)(p - data);
+        r = luaminiflac_parse_ogg_page(&data[pos],len - pos,page);
+        if(r == 1) return pos;
+        if(r == -1) {
+            *partial = pos;
+            break;
+        }
+        pos++;
+    }
+    return len;
+}
+
+static void
+luaminiflac_push_ogg_page(lua_State* L, const luaminiflac_ogg_page_t* page) {
+    lua_newtable(L);
+
+    lua_pushboolean(L,page->flags & 1);
+    lua_setfield(L,-2,"continued");
+    lua_pushboolean(L,page->flags & 2);
+    lua_setfield(L,-2,"bos");
+    lua_pushboolean(L,page->flags & 4);
+    lua_setfield(L,-2,"eos");
+    /* all bits set means no packet ends on this page */
+    if(page->granule != UINT64_MAX) {
+        luaminiflac_pushuint64(L,page->granule);
+        lua_setfield(L,-2,"granule");
+    }
+    lua_pushinteger(L,page->serial);
+    lua_setfield(L,-2,"serial");
+    lua_pushinteger(L,page->sequence);
+    lua_setfield(L,-2,"sequence");
+    lua_pushinteger(L,page->header_size);
+    lua_setfield(L,-2,"header_size");
+    lua_pushinteger(L,page->body_size);
+    lua_setfield(L,-2,"body_size");
+    lua_pushinteger(L,page->header_size + page->body_size);
+    lua_setfield(L,-2,"size");
+    lua_pushinteger(L,page->packets);
+    lua_setfield(L,-2,"packets");
+    lua_pushinteger(L,page->first_packet);
+    lua_setfield(L,-2,"first_packet");
+}
+
+static int
+luaminiflac_ogg_page(lua_State *L) {
+    /*
+     * ogg_page(data, pos)
+     * returns the position of the next complete Ogg page at or after
+     * pos (with a valid checksum), and a table of the page fields.
+     * if no page was found, returns nil and the position to resume
+     * searching from once more data is available */
+    luaminiflac_input_t in;
+    luaminiflac_ogg_page_t page;
+    size_t offset = 0;
+    size_t partial = 0;
+
+    luaminiflac_checkinput(L,1,NULL,1,&in);
+
+    offset = luaminiflac_find_ogg_page((const uint8_t*)in.str,in.len,in.pos,&page,&partial);
+    if(offset == in.len) {
+        lua_pushnil(L);
+        lua_pushinteger(L,(lua_Integer)partial + 1);
+        return 2;
+    }
+    lua_pushinteger(L,(lua_Integer)offset + 1);
+    luaminiflac_push_ogg_page(L,&page);
+    return 2;
+}
+
+/* }}} */
+
+/* parallel decoding {{{ */
+
+#define LUAMINIFLAC_MAX_THREADS 64
+/* a frame header, a CONSTANT subframe and the CRC-16 */
+#define LUAMINIFLAC_MIN_FRAME_SIZE 10
+
+typedef struct luaminiflac_streaminfo_s {
+    uint32_t min_block_size;
+    uint32_t max_block_size;
+    uint32_t min_frame_size;
+    uint32_t max_frame_size;
+    uint32_t sample_rate;
+    uint8_t channels;
+    uint8_t bps;
+    uint64_t total_samples;
+} luaminiflac_streaminfo_t;
+
+/* a worker decodes a run of frames into its slice of the output */
+typedef struct luaminiflac_parallel_job_s {
+    const uint8_t* data;
+    size_t len;
+    size_t audio_offset;
+    const luaminiflac_index_t* frames;
+    size_t first;
+    size_t last;
+    luaminiflac_t dec;
+    uint8_t channels;
+    LUAMINIFLAC_PCM format;
+    uint8_t* out;
+    uint64_t missing;    /* samples in frames that failed to decode */
+    luaminiflac_thread_t thread;
+} luaminiflac_parallel_job_t;
+
+/* reads the native FLAC metadata blocks, returns an error or NULL */
+static const char*
+luaminiflac_read_native_metadata(const uint8_t* data, size_t len, luaminiflac_streaminfo_t* si, size_t* audio_offset) {
+    size_t pos = 4;
+    size_t blen = 0;
+    const uint8_t* b = NULL;
+    int last = 0;
+    int found = 0;
+
+    if(len < 4 || memcmp(data,"fLaC",4) != 0) return "not a native FLAC stream";
+
+    while(!last) {
+        if(len - pos < 4) return "truncated metadata";
+        last = data[pos] & 0x80;
+        blen = ((size_t)data[pos+1] << 16) | ((size_t)data[pos+2] << 8) | data[pos+3];
+        if(len - pos - 4 < blen) return "truncated metadata";
+        b = &data[pos + 4];
+
+        if((data[pos] & 0x7F) == 0 && blen >= 34) {
+            si->min_block_size = ((uint32_t)b[0] << 8) | b[1];
+            si->max_block_size = ((uint32_t)b[2] << 8) | b[3];
+            si->min_frame_size = ((uint32_t)b[4] << 16) | ((uint32_t)b[5] << 8) | b[6];
+            si->max_frame_size = ((uint32_t)b[7] << 16) | ((uint32_t)b[8] << 8) | b[9];
+            si->sample_rate = ((uint32_t)b[10] << 12) | ((uint32_t)b[11] << 4) | (b[12] >> 4);
+            si->channels = (uint8_t)(((b[12] >> 1) & 0x07) + 1);
+            si->bps = (uint8_t)((((b[12] & 0x01) << 4) | (b[13] >> 4)) + 1);
+            si->total_samples = ((uint64_t)(b[13] & 0x0F) << 32)
+              | ((uint64_t)b[14] << 24) | ((uint64_t)b[15] << 16)
+              | ((uint64_t)b[16] << 8) | b[17];
+            found = 1;
+        }
+        pos += 4 + blen;
+    }
+
+    if(!found) return "missing STREAMINFO";
+    *audio_offset = pos;
+    return NULL;
+}
+
+/* checks a frame header found out of sequence by looking for the
+ * end of its frame with the CRC-16, within max_frame_size when
+ * STREAMINFO has one */
+static int
+luaminiflac_parallel_resync(const uint8_t* data, size_t len, size_t pos, const luaminiflac_frame_info_t* info, const luaminiflac_streaminfo_t* si) {
+    size_t window = len - pos;
+    size_t size = 0;
+    int eof = 1;
+
+    if(si->max_frame_size > 0 && window > (size_t)si->max_frame_size + 16) {
+        window = (size_t)si->max_frame_size + 16;
+        eof = 0;
+    }
+    return luaminiflac_frame_extent(&data[pos],window,info,eof,&size) == 1;
+}
+
+/* the most samples a damaged stretch of the file can have held,
+ * a block for every frame that fits in it */
+static uint64_t
+luaminiflac_parallel_max_gap(size_t skipped, const luaminiflac_streaminfo_t* si) {
+    size_t min_size = si->min_frame_size > LUAMINIFLAC_MIN_FRAME_SIZE ? si->min_frame_size : LUAMINIFLAC_MIN_FRAME_SIZE;
+    return ((uint64_t)(skipped / min_size) + 1) * si->max_block_size;
+}
+
+/* finds every frame after the metadata. a header has to match
+ * STREAMINFO and pick up where the previous frame left off, so a
+ * sync code inside of audio data isn't mistaken for a frame. after
+ * a damaged frame, decoding picks up again at the next frame that
+ * starts later in the stream and has a good CRC-16, as long as the
+ * samples it skips could have fit in the bytes skipped, so a bad
+ * header with a huge frame number can't size the output. returns
+ * how many samples were skipped over */
+static uint64_t
+luaminiflac_parallel_scan(lua_State* L, int idx, luaminiflac_index_t* frames, const uint8_t* data, size_t len, size_t pos, const luaminiflac_streaminfo_t* si) {
+    luaminiflac_frame_info_t info;
+    uint64_t expected = 0;
+    uint64_t sample = 0;
+    uint64_t missing = 0;
+    size_t partial = 0;
+    size_t last = pos; /* where the previous frame started */
+
+    while(pos < len) {
+        pos = luaminiflac_find_frame_header(data,len,pos,&info,&partial);
+        if(pos == len) break;
+
+        sample = info.blocking_strategy ? info.number : info.number * si->max_block_size;
+        if(info.channels == si->channels
+          && info.block_size <= si->max_block_size
+          && (info.bps == 0 || info.bps == si->bps)
+          && (info.sample_rate == 0 || info.sample_rate == si->sample_rate)
+          && (si->total_samples == 0 || sample + info.block_size <= si->total_samples)
+          && (sample == expected
+            || (sample > expected
+              && sample - expected <= luaminiflac_parallel_max_gap(pos - last,si)
+              && luaminiflac_parallel_resync(data,len,pos,&info,si)))) {
+            luaminiflac_index_append(L,idx,frames,pos,sample,info.block_size);
+            missing += sample - expected;
+            expected = sample + info.block_size;
+            last = pos;
+            pos += si->min_frame_size > info.header_size ? si->min_frame_size : info.header_size;
+        } else {
+            pos++;
+        }
+    }
+    return missing;
+}
+
+/* resets a worker's decoder and runs the metadata through, so
+ * STREAMINFO fills in any sample rate or bps left out of frame headers */
+static void
+luaminiflac_parallel_reset(luaminiflac_parallel_job_t* job) {
+    size_t pos = 0;
+    uint32_t used = 0;
+
+    miniflac_init(&job->dec.flac,MINIFLAC_CONTAINER_NATIVE);
+    while(pos < job->audio_offset) {
+        if(miniflac_sync(&job->dec.flac,&job->data[pos],(uint32_t)(job->audio_offset - pos),&used) != MINIFLAC_OK) break;
+        pos += used;
+    }
+}
+
+static void
+luaminiflac_parallel_worker(void* arg) {
+    luaminiflac_parallel_job_t* job = (luaminiflac_parallel_job_t*)arg;
+    const luaminiflac_index_entry_t* f = NULL;
+    uint8_t* dst = NULL;
+    size_t pos = 0;
+    size_t end = 0;
+    size_t i = 0;
+    uint32_t used = 0;
+    uint32_t u = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    job->missing = 0;
+    luaminiflac_parallel_reset(job);
+
+    for(i=job->first;i<job->last;i++) {
+        f = &job->frames->entries[i];
+        pos = (size_t)f->offset;
+        end = i + 1 < job->frames->count ? (size_t)job->frames->entries[i+1].offset : job->len;
+        if(end - pos > 0xFFFFFFFF) end = pos + 0xFFFFFFFF;
+
+        r = luaminiflac_sync_frame(&job->dec,&job->data[pos],(uint32_t)(end - pos),&used);
+        if(r == MINIFLAC_OK) {
+            r = miniflac_decode(&job->dec.flac,&job->data[pos + used],(uint32_t)(end - pos - used),&u,job->dec.samples);
+        }
+        if(r == MINIFLAC_OK
+          && (job->dec.flac.frame.header.block_size != f->block_size
+            || job->dec.flac.frame.header.channels != job->channels)) {
+            r = MINIFLAC_ERROR;
+        }
+        dst = &job->out[(size_t)f->sample * job->channels * luaminiflac_pcm_sizes[job->format]];
+        if(r != MINIFLAC_OK) {
+            /* the header passed the scan but the frame didn't decode
+             * (CONTINUE means it ran past the next frame's header), so
+             * it's left silent like the frames the scan skipped */
+            memset(dst,0,(size_t)f->block_size * job->channels * luaminiflac_pcm_sizes[job->format]);
+            job->missing += f->block_size;
+            luaminiflac_parallel_reset(job);
+            continue;
+        }
+
+        luaminiflac_pack_pcm(
+          dst,
+          job->dec.samples,
+          job->channels,
+          f->block_size,
+          job->dec.flac.frame.header.bps,
+          job->format);
+    }
+}
+
+static int
+luaminiflac_decode_file_parallel(lua_State *L) {
+    /*
+     * decode_file_parallel(path, { threads = N, format = "s16" })
+     * returns pcm, info, where pcm is the whole file as interleaved
+     * PCM in the requested format (see decode_pcm) and info has
+     * channels, bps, sample_rate, samples, frames and missing, the
+     * number of samples lost to damaged frames (left as silence).
+     * on failure returns nil, err */
+    const char* path = NULL;
+    lua_Integer threads = 0;
+    int format = LUAMINIFLAC_PCM_S16;
+    FILE* f = NULL;
+    long long flen = 0;
+    uint8_t* data = NULL;
+    size_t len = 0;
+    size_t audio_offset = 0;
+    size_t out_len = 0;
+    uint64_t total = 0;
+    uint64_t missing = 0;
+    size_t i = 0;
+    size_t c = 0;
+    const char* err = NULL;
+    uint8_t* out = NULL;
+    int32_t* samples = NULL;
+    luaminiflac_streaminfo_t si;
+    luaminiflac_index_t* frames = NULL;
+    luaminiflac_parallel_job_t* jobs = NULL;
+    int frames_idx = 0;
+
+    path = luaL_checkstring(L,1);
+    threads = (lua_Integer)luaminiflac_cpu_count();
+    if(lua_istable(L,2)) {
+        lua_getfield(L,2,"threads");
+        threads = luaL_optinteger(L,-1,threads);
+        lua_pop(L,1);
+        lua_getfield(L,2,"format");
+        format = luaL_checkoption(L,-1,"s16",luaminiflac_pcm_formats);
+        lua_pop(L,1);
+    }
+    if(threads < 1) threads = 1;
+    if(threads > LUAMINIFLAC_MAX_THREADS) threads = LUAMINIFLAC_MAX_THREADS;
+
+    f = fopen(path,"rb");
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: %s",path,strerror(errno));
+        return 2;
+    }
+    if(luaminiflac_fseek(f,0,SEEK_END) != 0
+      || (flen = (long long)luaminiflac_ftell(f)) < 0
+      || luaminiflac_fseek(f,0,SEEK_SET) != 0) {
+        fclose(f);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: %s",path,strerror(errno));
+        return 2;
+    }
+    if((unsigned long long)flen > (unsigned long long)(size_t)-1) {
+        fclose(f);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: file too large",path);
+        return 2;
+    }
+    len = (size_t)flen;
+    data = lua_newuserdata(L,len > 0 ? len : 1);
+    if(data == NULL || fread(data,1,len,f) != len) {
+        fclose(f);
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: read error",path);
+        return 2;
+    }
+    fclose(f);
+
+    memset(&si,0,sizeof(si));
+    err = luaminiflac_read_native_metadata(data,len,&si,&audio_offset);
+    if(err != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,err);
+        return 2;
+    }
+
+    frames = luaminiflac_index_new(L);
+    frames_idx = lua_gettop(L);
+    missing = luaminiflac_parallel_scan(L,frames_idx,frames,data,len,audio_offset,&si);
+
+    if(frames->count > 0) {
+        total = frames->entries[frames->count-1].sample + frames->entries[frames->count-1].block_size;
+    }
+    /* frames missing from the end leave no gap to count */
+    if(si.total_samples > 0 && total != si.total_samples) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: found frames for %f samples, STREAMINFO has %f",path,
+          (lua_Number)total,(lua_Number)si.total_samples);
+        return 2;
+    }
+    if(total > (uint64_t)((size_t)-1 / si.channels / luaminiflac_pcm_sizes[format])) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"%s: too many samples to decode at once",path);
+        return 2;
+    }
+    out_len = (size_t)total * si.channels * luaminiflac_pcm_sizes[format];
+    out = lua_newuserdata(L,out_len > 0 ? out_len : 1);
+    if(out == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    if(missing > 0) memset(out,0,out_len);
+
+    if((size_t)threads > frames->count) threads = (lua_Integer)frames->count;
+    if(threads > 0) {
+        jobs = lua_newuserdata(L,sizeof(luaminiflac_parallel_job_t) * (size_t)threads);
+        samples = lua_newuserdata(L,sizeof(int32_t) * si.max_block_size * si.channels * (size_t)threads);
+        if(jobs == NULL || samples == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+
+    for(i=0;i<(size_t)threads;i++) {
+        /* the decoder's stats and the rest are touched by sync_frame */
+        memset(&jobs[i],0,sizeof(luaminiflac_parallel_job_t));
+        jobs[i].data = data;
+        jobs[i].len = len;
+        jobs[i].audio_offset = audio_offset;
+        jobs[i].frames = frames;
+        jobs[i].first = frames->count * i / (size_t)threads;
+        jobs[i].last = frames->count * (i + 1) / (size_t)threads;
+        jobs[i].channels = si.channels;
+        jobs[i].format = (LUAMINIFLAC_PCM)format;
+        jobs[i].out = out;
+        jobs[i].dec.fd = -1;
+        for(c=0;c<8;c++) {
+            jobs[i].dec.samples[c] = c < si.channels
+              ? &samples[(i * si.channels + c) * si.max_block_size]
+              : NULL;
+        }
+    }
+
+    /* the first job runs on this thread, as do any
+     * jobs we couldn't start a thread for */
+    for(i=1;i<(size_t)threads;i++) {
+        if(!luaminiflac_thread_start(&jobs[i].thread,luaminiflac_parallel_worker,&jobs[i])) {
+            luaminiflac_parallel_worker(&jobs[i]);
+        }
+    }
+    if(threads > 0) {
+        luaminiflac_parallel_worker(&jobs[0]);
+    }
+    for(i=1;i<(size_t)threads;i++) {
+        luaminiflac_thread_join(&jobs[i].thread);
+    }
+
+    for(i=0;i<(size_t)threads;i++) {
+        missing += jobs[i].missing;
+    }
+
+    /* Lua strings can't be built in place, so this copy doubles the
+     * memory for the audio until the buffers are collected */
+    lua_pushlstring(L,(const char*)out,out_len);
+
+    lua_newtable(L);
+    lua_pushinteger(L,si.channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,si.bps);
+    lua_setfield(L,-2,"bps");
+    lua_pushinteger(L,si.sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+    lua_pushinteger(L,(lua_Integer)total);
+    lua_setfield(L,-2,"samples");
+    lua_pushinteger(L,(lua_Integer)frames->count);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,(lua_Integer)missing);
+    lua_setfield(L,-2,"missing");
+    lua_pushstring(L,luaminiflac_pcm_formats[format]);
+    lua_setfield(L,-2,"format");
+    return 2;
+}
+
+/* }}} */
+
+/* background decoding {{{ */
+
+/* a decoded frame waiting for try_pop */
+typedef struct luaminiflac_async_frame_s {
+    miniflac_frame_header_t header;
+    uint8_t channels;       /* in pcm, after channel selection */
+    uint16_t crc16;
+    uint8_t* pcm;
+    size_t len;
+    size_t cap;
+} luaminiflac_async_frame_t;
+
+#define LUAMINIFLAC_ASYNC_FRAMES 8
+
+/*
+ * decodes on a worker thread. input goes through a single-producer,
+ * single-consumer byte ring (Lua writes, the worker reads) and frames
+ * come back through a ring of slots (the worker writes, Lua reads).
+ * each side only writes its own counter, so neither side locks to
+ * move data. the event is only for the worker to sleep on when it
+ * has no input or no free slots.
+ */
+typedef struct luaminiflac_async_s {
+    luaminiflac_t dec;            /* only touched by the worker */
+    int32_t* samples;
+    size_t sample_cap;
+    LUAMINIFLAC_PCM format;
+
+    uint8_t* input;
+    size_t input_cap;             /* a power of 2 */
+    volatile size_t input_head;   /* bytes written, by Lua */
+    volatile size_t input_tail;   /* bytes read, by the worker */
+
+    luaminiflac_async_frame_t frames[LUAMINIFLAC_ASYNC_FRAMES];
+    volatile size_t frames_head;  /* frames published, by the worker */
+    volatile size_t frames_tail;  /* frames popped, by Lua */
+
+    volatile size_t finished;     /* no more input is coming */
+    volatile size_t stop;         /* the worker should exit */
+    volatile size_t done;         /* the worker has exited */
+    MINIFLAC_RESULT result;       /* why the worker exited, valid once done */
+
+    luaminiflac_event_t event;
+    int waiting;                  /* the worker is asleep, guarded by event */
+    int running;
+    luaminiflac_thread_t thread;
+} luaminiflac_async_t;
+
+/* wakes the worker if it's asleep, call after changing a counter */
+static void
+luaminiflac_async_wake(luaminiflac_async_t* a) {
+    luaminiflac_event_lock(&a->event);
+    if(a->waiting) {
+        luaminiflac_event_signal(&a->event);
+    }
+    luaminiflac_event_unlock(&a->event);
+}
+
+/* the worker is waiting on input, or a free frame slot */
+static int
+luaminiflac_async_ready(luaminiflac_async_t* a, int need_slot) {
+    if(luaminiflac_atomic_load(&a->stop)) return 1;
+    if(need_slot) {
+        return a->frames_head - luaminiflac_atomic_load(&a->frames_tail) < LUAMINIFLAC_ASYNC_FRAMES;
+    }
+    return luaminiflac_atomic_load(&a->input_head) != a->input_tail
+      || luaminiflac_atomic_load(&a->finished);
+}
+
+static void
+luaminiflac_async_sleep(luaminiflac_async_t* a, int need_slot) {
+    luaminiflac_event_lock(&a->event);
+    a->waiting = 1;
+    while(!luaminiflac_async_ready(a,need_slot)) {
+        luaminiflac_event_wait(&a->event);
+    }
+    a->waiting = 0;
+    luaminiflac_event_unlock(&a->event);
+}
+
+/* returns 0 on success, the worker can't use the Lua allocator.
+ * two more channels are kept after the decoded ones for downmixing */
+static int
+luaminiflac_async_expand_samples(luaminiflac_async_t* a, uint8_t channels, uint32_t block_size) {
+    size_t need = ((size_t)channels + 2) * block_size;
+    int32_t* samples = NULL;
+    unsigned int c = 0;
+
+    if(need > a->sample_cap) {
+        samples = realloc(a->samples,sizeof(int32_t) * need);
+        if(samples == NULL) return -1;
+        a->samples = samples;
+        a->sample_cap = need;
+    }
+    for(c=0;c<8;c++) {
+        a->dec.samples[c] = c < channels ? &a->samples[(size_t)c * block_size] : NULL;
+    }
+    return 0;
+}
+
+/* packs the decoded frame into the next free slot and publishes it */
+static MINIFLAC_RESULT
+luaminiflac_async_publish(luaminiflac_async_t* a) {
+    luaminiflac_async_frame_t* fr = NULL;
+    const miniflac_frame_header_t* h = &a->dec.flac.frame.header;
+    int32_t* out[8];
+    uint8_t channels = luaminiflac_select_output(&a->dec,&a->samples[(size_t)h->channels * h->block_size],h->block_size,out);
+    size_t len = (size_t)channels * h->block_size * luaminiflac_pcm_sizes[a->format];
+    uint8_t* pcm = NULL;
+
+    while(!luaminiflac_async_ready(a,1)) {
+        luaminiflac_async_sleep(a,1);
+    }
+    if(luaminiflac_atomic_load(&a->stop)) return MINIFLAC_OK;
+
+    fr = &a->frames[a->frames_head % LUAMINIFLAC_ASYNC_FRAMES];
+    if(len > fr->cap) {
+        pcm = realloc(fr->pcm,len);
+        if(pcm == NULL) return MINIFLAC_ERROR;
+        fr->pcm = pcm;
+        fr->cap = len;
+    }
+    luaminiflac_pack_pcm(fr->pcm,out,channels,h->block_size,h->bps,a->format);
+    fr->channels = channels;
+    fr->len = len;
+    fr->header = *h;
+    fr->crc16 = a->dec.flac.frame.crc16;
+
+    luaminiflac_atomic_store(&a->frames_head,a->frames_head + 1);
+    return MINIFLAC_OK;
+}
+
+static void
+luaminiflac_async_worker(void* arg) {
+    luaminiflac_async_t* a = (luaminiflac_async_t*)arg;
+    const uint8_t* data = NULL;
+    size_t avail = 0;
+    size_t start = 0;
+    uint32_t len = 0;
+    uint32_t used = 0;
+    uint32_t u = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    while(!luaminiflac_atomic_load(&a->stop)) {
+        avail = luaminiflac_atomic_load(&a->input_head) - a->input_tail;
+        if(avail == 0) {
+            if(luaminiflac_atomic_load(&a->finished)) {
+                /* finished may have been set right after more input */
+                if(luaminiflac_atomic_load(&a->input_head) == a->input_tail) break;
+                continue;
+            }
+            luaminiflac_async_sleep(a,0);
+            continue;
+        }
+
+        /* the readable part may wrap around, miniflac is fine
+         * with getting a frame in pieces */
+        start = a->input_tail & (a->input_cap - 1);
+        data = &a->input[start];
+        len = (uint32_t)(avail < a->input_cap - start ? avail : a->input_cap - start);
+
+        r = luaminiflac_sync_frame(&a->dec,data,len,&used);
+        if(r == MINIFLAC_OK) {
+            if(luaminiflac_async_expand_samples(a,a->dec.flac.frame.header.channels,a->dec.flac.frame.header.block_size) != 0) {
+                r = MINIFLAC_ERROR;
+            } else {
+                r = miniflac_decode(&a->dec.flac,&data[used],len - used,&u,a->dec.samples);
+                used += u;
+            }
+        }
+
+        luaminiflac_atomic_store(&a->input_tail,a->input_tail + used);
+
+        if(r == MINIFLAC_OK) {
+            r = luaminiflac_async_publish(a);
+        }
+        if(r != MINIFLAC_OK && r != MINIFLAC_CONTINUE) break;
+    }
+
+    /* stopping early isn't an error, running out of input mid-frame is */
+    if(r == MINIFLAC_CONTINUE && (luaminiflac_atomic_load(&a->stop) || !luaminiflac_truncated(&a->dec))) {
+        r = MINIFLAC_OK;
+    }
+    a->result = r;
+    luaminiflac_atomic_store(&a->done,1);
+}
+
+static int
+luaminiflac_async_decoder(lua_State *L) {
+    /*
+     * async_decoder(container, { format = "s16", buffer = 1048576, channels = spec })
+     * starts a worker thread that decodes input from :feed(),
+     * frames are collected with :try_pop(). channels is a spec
+     * like set_channels takes */
+    luaminiflac_async_t* a = NULL;
+    lua_Integer container = 0;
+    lua_Integer buffer = 1048576;
+    int format = LUAMINIFLAC_PCM_S16;
+    size_t cap = 4096;
+    unsigned int i = 0;
+
+    container = luaL_optinteger(L,1,(lua_Integer)MINIFLAC_CONTAINER_UNKNOWN);
+    switch(container) {
+        case MINIFLAC_CONTAINER_UNKNOWN: break;
+        case MINIFLAC_CONTAINER_NATIVE: break;
+        case MINIFLAC_CONTAINER_OGG: break;
+        default:
+            return luaL_error(L,"invalid container type");
+    }
+    if(lua_istable(L,2)) {
+        lua_getfield(L,2,"format");
+        format = luaL_checkoption(L,-1,"s16",luaminiflac_pcm_formats);
+        lua_pop(L,1);
+        lua_getfield(L,2,"buffer");
+        buffer = luaL_optinteger(L,-1,buffer);
+        lua_pop(L,1);
+    }
+    luaL_argcheck(L,buffer >= 4096 && buffer <= 0x40000000,2,"buffer must be between 4096 and 1073741824 bytes");
+    while(cap < (size_t)buffer) {
+        cap *= 2;
+    }
+
+    a = lua_newuserdata(L,sizeof(luaminiflac_async_t));
+    if(a == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    memset(a,0,sizeof(luaminiflac_async_t));
+    /* fixed before the worker starts, so it needs no locking */
+    if(lua_istable(L,2)) {
+        lua_getfield(L,2,"channels");
+        if(!lua_isnil(L,-1)) {
+            luaminiflac_check_output(L,lua_gettop(L),"opts.channels",&a->dec);
+        }
+        lua_pop(L,1);
+    }
+    luaL_setmetatable(L,luaminiflac_async_mt);
+
+    /* shared with the worker, so it's malloc'd and freed in close */
+    a->input = malloc(cap);
+    if(a->input == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    a->input_cap = cap;
+    a->format = (LUAMINIFLAC_PCM)format;
+    for(i=0;i<8;i++) {
+        a->dec.samples[i] = NULL;
+    }
+    miniflac_init(&a->dec.flac,(MINIFLAC_CONTAINER)container);
+
+    luaminiflac_event_init(&a->event);
+    a->running = 1;
+    if(!luaminiflac_thread_start(&a->thread,luaminiflac_async_worker,a)) {
+        a->running = 0;
+        luaminiflac_event_free(&a->event);
+        free(a->input);
+        a->input = NULL;
+        return luaL_error(L,"unable to start decoder thread");
+    }
+    return 1;
+}
+
+static int
+luaminiflac_async_feed(lua_State *L) {
+    /* returns the number of bytes taken, which is less than
+     * the length of data when the input buffer is full */
+    luaminiflac_async_t* a = NULL;
+    const char* data = NULL;
+    size_t len = 0;
+    size_t space = 0;
+    size_t start = 0;
+    size_t n = 0;
+
+    a = luaL_checkudata(L,1,luaminiflac_async_mt);
+    data = luaL_checklstring(L,2,&len);
+    if(!a->running) {
+        return luaL_error(L,"decoder is closed");
+    }
+    if(a->finished) {
+        return luaL_error(L,"decoder is finished");
+    }
+
+    space = a->input_cap - (a->input_head - luaminiflac_atomic_load(&a->input_tail));
+    if(len > space) len = space;
+
+    start = a->input_head & (a->input_cap - 1);
+    n = len < a->input_cap - start ? len : a->input_cap - start;
+    memcpy(&a->input[start],data,n);
+    memcpy(a->input,&data[n],len - n);
+    if(len > 0) {
+        luaminiflac_atomic_store(&a->input_head,a->input_head + len);
+        luaminiflac_async_wake(a);
+    }
+
+    lua_pushinteger(L,(lua_Integer)len);
+    return 1;
+}
+
+static int
+luaminiflac_async_finish(lua_State *L) {
+    /* marks the end of input */
+    luaminiflac_async_t* a = luaL_checkudata(L,1,luaminiflac_async_mt);
+    if(a->running) {
+        luaminiflac_atomic_store(&a->finished,1);
+        luaminiflac_async_wake(a);
+    }
+    return 0;
+}
+
+static int
+luaminiflac_async_try_pop(lua_State *L) {
+    /*
+     * returns the next decoded frame (like decode_pcm), false if
+     * no frame is ready yet, or nil once the worker is done -
+     * with an error code if it stopped on an error, or
+     * MINIFLAC_CONTINUE if the input ended partway through a frame */
+    luaminiflac_async_t* a = NULL;
+    luaminiflac_async_frame_t* fr = NULL;
+    size_t done = 0;
+
+    a = luaL_checkudata(L,1,luaminiflac_async_mt);
+    if(!a->running) {
+        return luaL_error(L,"decoder is closed");
+    }
+
+    done = luaminiflac_atomic_load(&a->done);
+    if(luaminiflac_atomic_load(&a->frames_head) == a->frames_tail) {
+        if(!done) {
+            lua_pushboolean(L,0);
+            return 1;
+        }
+        lua_pushnil(L);
+        if(a->result != MINIFLAC_OK) {
+            lua_pushinteger(L,a->result);
+            return 2;
+        }
+        return 1;
+    }
+
+    fr = &a->frames[a->frames_tail % LUAMINIFLAC_ASYNC_FRAMES];
+
+    lua_newtable(L);
+    lua_pushstring(L,"frame");
+    lua_setfield(L,-2,"type");
+
+    lua_newtable(L);
+    luaminiflac_push_frame_header(L,&fr->header);
+    lua_setfield(L,-2,"header");
+    lua_pushlstring(L,(const char*)fr->pcm,fr->len);
+    lua_setfield(L,-2,"pcm");
+    lua_pushstring(L,luaminiflac_pcm_formats[a->format]);
+    lua_setfield(L,-2,"format");
+    lua_pushinteger(L,fr->channels);
+    lua_setfield(L,-2,"channels");
+    lua_newtable(L);
+    lua_pushinteger(L,fr->crc16);
+    lua_setfield(L,-2,"crc16");
+    lua_setfield(L,-2,"footer");
+    lua_setfield(L,-2,"frame");
+
+    luaminiflac_atomic_store(&a->frames_tail,a->frames_tail + 1);
+    luaminiflac_async_wake(a);
+    return 1;
+}
+
+static int
+luaminiflac_async_close(lua_State *L) {
+    /* stops the worker and frees everything, also used for __gc */
+    luaminiflac_async_t* a = NULL;
+    unsigned int i = 0;
+
+    a = luaL_checkudata(L,1,luaminiflac_async_mt);
+    if(!a->running) return 0;
+
+    luaminiflac_atomic_store(&a->stop,1);
+    luaminiflac_async_wake(a);
+    luaminiflac_thread_join(&a->thread);
+    a->running = 0;
+
+    luaminiflac_event_free(&a->event);
+    free(a->input);
+    free(a->samples);
+    a->input = NULL;
+    a->samples = NULL;
+    for(i=0;i<LUAMINIFLAC_ASYNC_FRAMES;i++) {
+        free(a->frames[i].pcm);
+        a->frames[i].pcm = NULL;
+    }
+    return 0;
+}
+
+static const struct luaL_Reg luaminiflac_async_methods[] = {
+    { "feed",    luaminiflac_async_feed    },
+    { "finish",  luaminiflac_async_finish  },
+    { "try_pop", luaminiflac_async_try_pop },
+    { "close",   luaminiflac_async_close   },
+    { NULL,      NULL                      },
+};
+
+/* }}} */
+
+/* ffi abi {{{ */
+
+/* plain C entry points over the decoder core, so LuaJIT can call
+ * them through the FFI and keep its decode loop compiled. the public
+ * part of luaminiflac_ffi_t is repeated in the ffi.cdef in
+ * src/miniflac/ffi.lua, keep the two in sync. the miniflac_t comes
+ * last and is never touched from Lua */
+
+typedef struct luaminiflac_ffi_frame_s {
+    uint64_t sample_number;      /* when blocking_strategy is 1 */
+    uint32_t frame_number;       /* when blocking_strategy is 0 */
+    uint32_t block_size;
+    uint32_t sample_rate;
+    uint8_t channels;
+    uint8_t bps;
+    uint8_t blocking_strategy;
+    uint8_t channel_assignment;
+} luaminiflac_ffi_frame_t;
+
+typedef struct luaminiflac_ffi_s {
+    int32_t* samples[8];         /* per channel, valid after decode */
+    luaminiflac_ffi_frame_t frame;
+    int32_t state;               /* MINIFLAC_STATE */
+    int32_t metadata_type;       /* when state is MINIFLAC_METADATA */
+    uint32_t metadata_length;
+    int32_t metadata_is_last;
+    /* private */
+    int32_t* samplebuf;
+    uint32_t sample_channels;
+    uint32_t sample_capacity;
+    miniflac_t flac;
+} luaminiflac_ffi_t;
+
+static void
+luaminiflac_ffi_update(luaminiflac_ffi_t* dec) {
+    const miniflac_frame_header_t* header = &dec->flac.frame.header;
+
+    dec->state = (int32_t)dec->flac.state;
+    if(dec->flac.state == MINIFLAC_METADATA) {
+        dec->metadata_type = (int32_t)dec->flac.metadata.header.type;
+        dec->metadata_length = dec->flac.metadata.header.length;
+        dec->metadata_is_last = dec->flac.metadata.header.is_last;
+        return;
+    }
+
+    dec->frame.blocking_strategy = header->blocking_strategy;
+    dec->frame.sample_number = header->blocking_strategy ? header->sample_number : 0;
+    dec->frame.frame_number = header->blocking_strategy ? 0 : header->frame_number;
+    dec->frame.block_size = header->block_size;
+    dec->frame.sample_rate = header->sample_rate;
+    dec->frame.channels = header->channels;
+    dec->frame.bps = header->bps;
+    dec->frame.channel_assignment = (uint8_t)header->channel_assignment;
+}
+
+/* same growth rule as luaminiflac_expand_samples, but on the C heap */
+static int
+luaminiflac_ffi_expand_samples(luaminiflac_ffi_t* dec, uint8_t channels, uint32_t block_size) {
+    int32_t* samplebuf = NULL;
+    unsigned int c = 0;
+
+    if(channels <= dec->sample_channels && block_size <= dec->sample_capacity) return 0;
+    if(channels < dec->sample_channels) channels = (uint8_t)dec->sample_channels;
+    if(block_size < dec->sample_capacity) block_size = dec->sample_capacity;
+
+    samplebuf = malloc(sizeof(int32_t) * (size_t)channels * (size_t)block_size);
+    if(samplebuf == NULL) return -1;
+    free(dec->samplebuf);
+
+    dec->samplebuf = samplebuf;
+    dec->sample_channels = channels;
+    dec->sample_capacity = block_size;
+    for(c=0;c<8;c++) {
+        dec->samples[c] = c < channels ? &samplebuf[c * block_size] : NULL;
+    }
+    return 0;
+}
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    container = luaL_optinteger(L,2,(lua_Integer)MINIFLAC_CONTAINER_UNKNOWN);
+/* returns -1 on an invalid container */
+LUAMINIFLAC_PUBLIC int
+luaminiflac_ffi_reset(luaminiflac_ffi_t* dec, int container) {
     switch(container) {
         case MINIFLAC_CONTAINER_UNKNOWN: break;
         case MINIFLAC_CONTAINER_NATIVE: break;
         case MINIFLAC_CONTAINER_OGG: break;
-        default:
-            return luaL_error(L,"invalid container type");
+        default: return -1;
     }
-    miniflac_init(&lFlac->flac,(MINIFLAC_CONTAINER)container);
+    miniflac_init(&dec->flac,(MINIFLAC_CONTAINER)container);
+    memset(&dec->frame,0,sizeof(dec->frame));
+    dec->state = (int32_t)dec->flac.state;
+    dec->metadata_type = 0;
+    dec->metadata_length = 0;
+    dec->metadata_is_last = 0;
     return 0;
 }
 
-static int
-luaminiflac_miniflac_sync(lua_State *L) {
-    /*
-     * returns result, err, remain
-     * on MINIFLAC_CONTINUE, result = false, rem is likely 0 bytes
-     * on error, result = nil and err is set
-     * err is only set on error, nil otherwise */
-    luaminiflac_t *lFlac = NULL;
-    const char* str = NULL;
-    size_t      len = 0;
-    uint32_t   used = 0;
-    MINIFLAC_RESULT r;
+/* returns NULL on an invalid container or when out of memory */
+LUAMINIFLAC_PUBLIC luaminiflac_ffi_t*
+luaminiflac_ffi_new(int container) {
+    luaminiflac_ffi_t* dec = NULL;
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing parameter data");
+    dec = calloc(1,sizeof(luaminiflac_ffi_t));
+    if(dec == NULL) return NULL;
+    if(luaminiflac_ffi_reset(dec,container) != 0) {
+        free(dec);
+        return NULL;
     }
+    return dec;
+}
 
-    r = miniflac_sync(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used);
-
-    switch(r) {
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            lua_pushlstring(L,&str[used],len-used);
-            return 3;
-        }
-        case MINIFLAC_OK: {
-            luaminiflac_push_header(L,lFlac);
-            lua_pushnil(L);
-            lua_pushlstring(L,&str[used],len-used);
-            return 3;
-        }
-        default: break;
-    }
-    lua_pushnil(L);
-    lua_pushinteger(L,r);
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
+LUAMINIFLAC_PUBLIC void
+luaminiflac_ffi_free(luaminiflac_ffi_t* dec) {
+    if(dec == NULL) return;
+    free(dec->samplebuf);
+    free(dec);
 }
 
+/* miniflac_sync, on MINIFLAC_OK the state and either the metadata
+ * header or the frame header are filled in */
+LUAMINIFLAC_PUBLIC int
+luaminiflac_ffi_sync(luaminiflac_ffi_t* dec, const uint8_t* data, uint32_t len, uint32_t* used) {
+    MINIFLAC_RESULT r = MINIFLAC_OK;
 
-static int
-luaminiflac_miniflac_decode(lua_State *L) {
-    /*
-     * returns result, err, rem
-     * on MINIFLAC_CONTINUE, result = false, rem is likely 0 bytes
-     * on error, result = nil and err is set
-     * err is only set on error, nil otherwise
-     * result is a multidimensional tables of samples */
-    luaminiflac_t *lFlac = NULL;
-    const char* str = NULL;
-    size_t      len = 0;
-    uint32_t   used = 0;
-    MINIFLAC_RESULT r;
+    r = miniflac_sync(&dec->flac,data,len,used);
+    if(r == MINIFLAC_OK) luaminiflac_ffi_update(dec);
+    return (int)r;
+}
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
+/* syncs to the next frame, skipping metadata, and decodes it into
+ * samples. returns MINIFLAC_ERROR if the sample buffer can't grow */
+LUAMINIFLAC_PUBLIC int
+luaminiflac_ffi_decode(luaminiflac_ffi_t* dec, const uint8_t* data, uint32_t len, uint32_t* used) {
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+    uint32_t u = 0;
+
+    *used = 0;
+    while(!(dec->flac.state == MINIFLAC_FRAME && dec->flac.frame.state != MINIFLAC_FRAME_HEADER)) {
+        r = miniflac_sync(&dec->flac,&data[*used],len - *used,&u);
+        *used += u;
+        if(r != MINIFLAC_OK) return (int)r;
     }
 
-    r = miniflac_decode(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,(int32_t**)lFlac->samples);
-
-    switch(r) {
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            lua_pushlstring(L,&str[used],len-used);
-            return 3;
-        }
-        case MINIFLAC_OK: {
-            luaminiflac_push_frame(L,lFlac);
-            lua_pushnil(L);
-            lua_pushlstring(L,&str[used],len-used);
-            return 3;
-        }
-        default: break;
+    if(luaminiflac_ffi_expand_samples(dec,
+      dec->flac.frame.header.channels,
+      dec->flac.frame.header.block_size) != 0) {
+        return (int)MINIFLAC_ERROR;
     }
-    lua_pushnil(L);
-    lua_pushinteger(L,r);
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
+
+    r = miniflac_decode(&dec->flac,&data[*used],len - *used,&u,dec->samples);
+    *used += u;
+    if(r == MINIFLAC_OK) luaminiflac_ffi_update(dec);
+    return (int)r;
 }
 
-/* closure for getting a uint8_t */
-static int
-luaminiflac_read_uint8(lua_State *L) {
-    luaminiflac_t *lFlac      = NULL;
-    const char* str           = NULL;
-    size_t      len           = 0;
-    uint32_t   used           = 0;
-    uint8_t     val           = 0;
-    luaminiflac_uint8_func f = NULL;
-    MINIFLAC_RESULT r;
+/* }}} */
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
+/* block parsers {{{ */
+
+/*
+ * each read_* block parser builds the whole table for a metadata
+ * block in one call. if it runs out of data, the partial table is
+ * kept in the uservalue and the meta_* fields record which step
+ * to pick up from on the next call. every step is guarded by
+ * its step number, so on resume earlier steps are skipped.
+ */
+
+#define LUAMINIFLAC_FIELD(state, n, func, val, push, name) \
+    if((state) == (n)) { \
+        r = miniflac_ ## func(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&val); \
+        rd->used += u; \
+        if(r != MINIFLAC_OK) return r; \
+        push; \
+        lua_setfield(L,-2,name); \
+        (state)++; \
     }
-    f = (luaminiflac_uint8_func)lua_touserdata(L,lua_upvalueindex(1));
 
-    r = f(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,&val);
-
-    /* treat METADATA_END like CONTINUE, the coroutine interface tracks that we've
-     * read the right number of comments / bytes / whatever */
-    switch(r) {
-        case MINIFLAC_METADATA_END: /* fall-through */
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            break;
-        }
-        case MINIFLAC_OK: {
-            lua_pushinteger(L,val);
-            lua_pushnil(L);
-            break;
-        }
-        default: {
-            lua_pushnil(L);
-            lua_pushinteger(L,r);
-            break;
-        }
+#define LUAMINIFLAC_STRING(state, n, func, suffix, name, trim) \
+    if((state) == (n)) { \
+        r = miniflac_ ## func ## _length(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&lFlac->meta_len); \
+        rd->used += u; \
+        if(r != MINIFLAC_OK) return r; \
+        (state)++; \
+    } \
+    if((state) == (n) + 1) { \
+        r = luaminiflac_block_string(L,lFlac,rd,miniflac_ ## func ## _ ## suffix,trim); \
+        if(r != MINIFLAC_OK) return r; \
+        lua_setfield(L,-2,name); \
+        (state)++; \
     }
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
-}
 
-/* closure for getting a uint16_t */
-static int
-luaminiflac_read_uint16(lua_State *L) {
-    luaminiflac_t *lFlac      = NULL;
-    const char* str           = NULL;
-    size_t      len           = 0;
-    uint32_t   used           = 0;
-    uint16_t    val           = 0;
-    luaminiflac_uint16_func f = NULL;
+#define LUAMINIFLAC_INTEGER(v) lua_pushinteger(L,(v))
+#define LUAMINIFLAC_BOOLEAN(v) lua_pushboolean(L,(v))
+#define LUAMINIFLAC_UINT64(v) luaminiflac_pushuint64(L,(v))
+
+/* reads a string of meta_len bytes, if trim is set the string
+ * ends at the first NUL and an empty string is pushed as nil */
+static MINIFLAC_RESULT
+luaminiflac_block_string(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd, luaminiflac_str_func f, int trim) {
+    uint32_t u = 0;
+    uint32_t len = 0;
+    const uint8_t* nul = NULL;
     MINIFLAC_RESULT r;
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
-    }
-    f = (luaminiflac_uint16_func)lua_touserdata(L,lua_upvalueindex(1));
-
-    r = f(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,&val);
+    luaminiflac_expand_buffer(L,1,lFlac,lFlac->meta_len);
+    r = f(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,lFlac->buffer,lFlac->meta_len,&len);
+    rd->used += u;
+    if(r != MINIFLAC_OK) return r;
 
-    switch(r) {
-        case MINIFLAC_METADATA_END: /* fall-through */
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            break;
+    if(trim) {
+        nul = memchr(lFlac->buffer,0,len);
+        if(nul != NULL) {
+            len = (uint32_t)(nul - lFlac->buffer);
         }
-        case MINIFLAC_OK: {
-            lua_pushinteger(L,val);
-            lua_pushnil(L);
-            break;
-        }
-        default: {
+        if(len == 0) {
             lua_pushnil(L);
-            lua_pushinteger(L,r);
-            break;
+            return r;
         }
     }
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
+    lua_pushlstring(L,(const char*)lFlac->buffer,len);
+    return r;
 }
 
-/* closure for getting a uint32_t */
-static int
-luaminiflac_read_uint32(lua_State *L) {
-    luaminiflac_t *lFlac      = NULL;
-    const char* str           = NULL;
-    size_t      len           = 0;
-    uint32_t   used           = 0;
-    uint32_t    val           = 0;
-    luaminiflac_uint32_func f = NULL;
-    MINIFLAC_RESULT r;
-
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
+static MINIFLAC_RESULT
+luaminiflac_block_streaminfo(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    uint8_t v8 = 0;
+    uint16_t v16 = 0;
+    uint32_t v32 = 0;
+    uint64_t v64 = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    LUAMINIFLAC_FIELD(lFlac->meta_step,1,streaminfo_min_block_size,v16,LUAMINIFLAC_INTEGER(v16),"min_block_size")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,2,streaminfo_max_block_size,v16,LUAMINIFLAC_INTEGER(v16),"max_block_size")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,3,streaminfo_min_frame_size,v32,LUAMINIFLAC_INTEGER(v32),"min_frame_size")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,4,streaminfo_max_frame_size,v32,LUAMINIFLAC_INTEGER(v32),"max_frame_size")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,5,streaminfo_sample_rate,v32,LUAMINIFLAC_INTEGER(v32),"sample_rate")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,6,streaminfo_channels,v8,LUAMINIFLAC_INTEGER(v8),"channels")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,7,streaminfo_bps,v8,LUAMINIFLAC_INTEGER(v8),"bps")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,8,streaminfo_total_samples,v64,LUAMINIFLAC_UINT64(v64),"total_samples")
+    LUAMINIFLAC_STRING(lFlac->meta_step,9,streaminfo_md5,data,"md5",0)
+
+    /* keep the expected hash for :verify() */
+    if(lFlac->meta_len == 16) {
+        memcpy(lFlac->md5_expected,lFlac->buffer,16);
+        lFlac->md5_expected_set = 1;
     }
-    f = (luaminiflac_uint32_func)lua_touserdata(L,lua_upvalueindex(1));
-
-    r = f(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,&val);
+    return r;
+}
 
-    switch(r) {
-        case MINIFLAC_METADATA_END: /* fall-through */
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            break;
-        }
-        case MINIFLAC_OK: {
-            lua_pushinteger(L,val);
-            lua_pushnil(L);
-            break;
+static MINIFLAC_RESULT
+luaminiflac_block_seektable(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    uint16_t v16 = 0;
+    uint64_t v64 = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    if(lFlac->meta_step == 1) {
+        r = miniflac_seektable_seekpoints(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&lFlac->meta_count);
+        rd->used += u;
+        if(r != MINIFLAC_OK) return r;
+        lua_createtable(L,lFlac->meta_count,0);
+        lua_setfield(L,-2,"seekpoints");
+        lFlac->meta_i = 0;
+        lFlac->meta_sub = 0;
+        lFlac->meta_step++;
+    }
+    if(lFlac->meta_step == 2) {
+        lua_getfield(L,-1,"seekpoints");
+        while(lFlac->meta_i < lFlac->meta_count) {
+            if(lFlac->meta_sub == 0) {
+                lua_createtable(L,0,3);
+                lua_rawseti(L,-2,lFlac->meta_i + 1);
+                lFlac->meta_sub++;
+            }
+            lua_rawgeti(L,-1,lFlac->meta_i + 1);
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,1,seektable_sample_number,v64,LUAMINIFLAC_UINT64(v64),"sample_number")
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,2,seektable_sample_offset,v64,LUAMINIFLAC_UINT64(v64),"sample_offset")
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,3,seektable_samples,v16,LUAMINIFLAC_INTEGER(v16),"samples")
+            lua_pop(L,1);
+            lFlac->meta_sub = 0;
+            lFlac->meta_i++;
         }
-        default: {
-            lua_pushnil(L);
-            lua_pushinteger(L,r);
-            break;
+        lua_pop(L,1);
+        lFlac->meta_step++;
+    }
+    return r;
+}
+
+static MINIFLAC_RESULT
+luaminiflac_block_vorbis_comment(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    LUAMINIFLAC_STRING(lFlac->meta_step,1,vorbis_comment_vendor,string,"vendor_string",0)
+    if(lFlac->meta_step == 3) {
+        r = miniflac_vorbis_comment_total(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&lFlac->meta_count);
+        rd->used += u;
+        if(r != MINIFLAC_OK) return r;
+        lua_createtable(L,lFlac->meta_count,0);
+        lua_setfield(L,-2,"comments");
+        lFlac->meta_i = 0;
+        lFlac->meta_sub = 0;
+        lFlac->meta_step++;
+    }
+    if(lFlac->meta_step == 4) {
+        lua_getfield(L,-1,"comments");
+        while(lFlac->meta_i < lFlac->meta_count) {
+            if(lFlac->meta_sub == 0) {
+                r = miniflac_vorbis_comment_length(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&lFlac->meta_len);
+                rd->used += u;
+                if(r != MINIFLAC_OK) return r;
+                lFlac->meta_sub++;
+            }
+            r = luaminiflac_block_string(L,lFlac,rd,miniflac_vorbis_comment_string,0);
+            if(r != MINIFLAC_OK) return r;
+            lua_rawseti(L,-2,lFlac->meta_i + 1);
+            lFlac->meta_sub = 0;
+            lFlac->meta_i++;
         }
+        lua_pop(L,1);
+        lFlac->meta_step++;
     }
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
+    return r;
 }
 
-/* closure for getting a uint64_t */
-static int
-luaminiflac_read_uint64(lua_State *L) {
-    luaminiflac_t *lFlac      = NULL;
-    const char* str           = NULL;
-    size_t      len           = 0;
-    uint32_t   used           = 0;
-    uint64_t    val           = 0;
-    luaminiflac_uint64_func f = NULL;
-    MINIFLAC_RESULT r;
+static MINIFLAC_RESULT
+luaminiflac_block_picture(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    uint32_t v32 = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    LUAMINIFLAC_FIELD(lFlac->meta_step,1,picture_type,v32,LUAMINIFLAC_INTEGER(v32),"type")
+    LUAMINIFLAC_STRING(lFlac->meta_step,2,picture_mime,string,"mime",0)
+    LUAMINIFLAC_STRING(lFlac->meta_step,4,picture_description,string,"description",0)
+    LUAMINIFLAC_FIELD(lFlac->meta_step,6,picture_width,v32,LUAMINIFLAC_INTEGER(v32),"width")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,7,picture_height,v32,LUAMINIFLAC_INTEGER(v32),"height")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,8,picture_colordepth,v32,LUAMINIFLAC_INTEGER(v32),"colordepth")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,9,picture_totalcolors,v32,LUAMINIFLAC_INTEGER(v32),"totalcolors")
+    LUAMINIFLAC_STRING(lFlac->meta_step,10,picture,data,"data",0)
+    return r;
+}
 
-    lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
-    }
-    f = (luaminiflac_uint64_func)lua_touserdata(L,lua_upvalueindex(1));
+static MINIFLAC_RESULT
+luaminiflac_block_application(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    uint32_t v32 = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
 
-    r = f(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,&val);
+    LUAMINIFLAC_FIELD(lFlac->meta_step,1,application_id,v32,LUAMINIFLAC_INTEGER(v32),"id")
+    LUAMINIFLAC_STRING(lFlac->meta_step,2,application,data,"data",0)
+    return r;
+}
 
-    switch(r) {
-        case MINIFLAC_METADATA_END: /* fall-through */
-        case MINIFLAC_CONTINUE: {
-            lua_pushboolean(L,0);
-            lua_pushnil(L);
-            break;
-        }
-        case MINIFLAC_OK: {
-            luaminiflac_pushuint64(L,val);
-            lua_pushnil(L);
-            break;
-        }
-        default: {
-            lua_pushnil(L);
-            lua_pushinteger(L,r);
-            break;
+static MINIFLAC_RESULT
+luaminiflac_block_cuesheet(lua_State* L, luaminiflac_t* lFlac, luaminiflac_reader_t* rd) {
+    uint32_t u = 0;
+    uint8_t v8 = 0;
+    uint64_t v64 = 0;
+    MINIFLAC_RESULT r = MINIFLAC_OK;
+
+    LUAMINIFLAC_STRING(lFlac->meta_step,1,cuesheet_catalog,string,"catalog",1)
+    LUAMINIFLAC_FIELD(lFlac->meta_step,3,cuesheet_leadin,v64,LUAMINIFLAC_UINT64(v64),"leadin")
+    LUAMINIFLAC_FIELD(lFlac->meta_step,4,cuesheet_cd_flag,v8,LUAMINIFLAC_BOOLEAN(v8),"cd_flag")
+    if(lFlac->meta_step == 5) {
+        r = miniflac_cuesheet_tracks(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&v8);
+        rd->used += u;
+        if(r != MINIFLAC_OK) return r;
+        lFlac->meta_count = v8;
+        lua_createtable(L,lFlac->meta_count,0);
+        lua_setfield(L,-2,"tracks");
+        lFlac->meta_i = 0;
+        lFlac->meta_sub = 0;
+        lFlac->meta_step++;
+    }
+    if(lFlac->meta_step == 6) {
+        lua_getfield(L,-1,"tracks");
+        while(lFlac->meta_i < lFlac->meta_count) {
+            if(lFlac->meta_sub == 0) {
+                lua_createtable(L,0,6);
+                lua_newtable(L);
+                lua_setfield(L,-2,"indexpoints");
+                lua_rawseti(L,-2,lFlac->meta_i + 1);
+                lFlac->meta_sub++;
+            }
+            lua_rawgeti(L,-1,lFlac->meta_i + 1);
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,1,cuesheet_track_offset,v64,LUAMINIFLAC_UINT64(v64),"offset")
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,2,cuesheet_track_number,v8,LUAMINIFLAC_INTEGER(v8),"number")
+            LUAMINIFLAC_STRING(lFlac->meta_sub,3,cuesheet_track_isrc,string,"isrc",1)
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,5,cuesheet_track_audio_flag,v8,LUAMINIFLAC_BOOLEAN(v8),"audio_flag")
+            LUAMINIFLAC_FIELD(lFlac->meta_sub,6,cuesheet_track_preemph_flag,v8,LUAMINIFLAC_BOOLEAN(v8),"preemph_flag")
+            if(lFlac->meta_sub == 7) {
+                r = miniflac_cuesheet_track_indexpoints(&lFlac->flac,&rd->data[rd->used],rd->len - rd->used,&u,&v8);
+                rd->used += u;
+                if(r != MINIFLAC_OK) return r;
+                lFlac->meta_count2 = v8;
+                lFlac->meta_j = 0;
+                lFlac->meta_subsub = 0;
+                lFlac->meta_sub++;
+            }
+            if(lFlac->meta_sub == 8) {
+                lua_getfield(L,-1,"indexpoints");
+                while(lFlac->meta_j < lFlac->meta_count2) {
+                    if(lFlac->meta_subsub == 0) {
+                        lua_createtable(L,0,2);
+                        lua_rawseti(L,-2,lFlac->meta_j + 1);
+                        lFlac->meta_subsub++;
+                    }
+                    lua_rawgeti(L,-1,lFlac->meta_j + 1);
+                    LUAMINIFLAC_FIELD(lFlac->meta_subsub,1,cuesheet_index_point_offset,v64,LUAMINIFLAC_UINT64(v64),"offset")
+                    LUAMINIFLAC_FIELD(lFlac->meta_subsub,2,cuesheet_index_point_number,v8,LUAMINIFLAC_INTEGER(v8),"number")
+                    lua_pop(L,1);
+                    lFlac->meta_subsub = 0;
+                    lFlac->meta_j++;
+                }
+                lua_pop(L,1);
+            }
+            lua_pop(L,1);
+            lFlac->meta_sub = 0;
+            lFlac->meta_i++;
         }
+        lua_pop(L,1);
+        lFlac->meta_step++;
     }
-    lua_pushlstring(L,&str[used],len-used);
-    return 3;
+    return r;
 }
 
-/* closure for getting a string */
+#undef LUAMINIFLAC_FIELD
+#undef LUAMINIFLAC_STRING
+#undef LUAMINIFLAC_INTEGER
+#undef LUAMINIFLAC_BOOLEAN
+#undef LUAMINIFLAC_UINT64
+
+/* closure for reading a whole metadata block */
 static int
-luaminiflac_read_str(lua_State *L) {
-    luaminiflac_t *lFlac   = NULL;
-    const char* str        = NULL;
-    size_t      len        = 0;
-    uint32_t   used        = 0;
-    uint32_t   maxlen      = 0;
-    luaminiflac_str_func f = NULL;
+luaminiflac_read_block(lua_State *L) {
+    /*
+     * returns result, err, remain like the other closures,
+     * result is the table for the block */
+    luaminiflac_t *lFlac     = NULL;
+    luaminiflac_input_t in;
+    luaminiflac_reader_t rd;
+    luaminiflac_block_func f = NULL;
+    int top = 0;
     MINIFLAC_RESULT r;
 
     lFlac = luaL_checkudata(L,1,luaminiflac_mt);
-    str   = lua_tolstring(L,2,&len);
-    if(str == NULL) {
-        return luaL_error(L,"missing data");
+    luaminiflac_checkinput(L,2,lFlac,lua_toboolean(L,lua_upvalueindex(2)),&in);
+    f = (luaminiflac_block_func)lua_touserdata(L,lua_upvalueindex(1));
+
+    lua_getuservalue(L,1);
+    if(lFlac->meta_step == 0) {
+        lua_newtable(L);
+        lua_pushvalue(L,-1);
+        lua_setfield(L,-3,"meta");
+        lFlac->meta_step = 1;
+    } else {
+        lua_getfield(L,-1,"meta");
     }
-    maxlen = luaL_optinteger(L,3,0);
-    f = (luaminiflac_str_func)lua_touserdata(L,lua_upvalueindex(1));
+    top = lua_gettop(L);
 
-    luaminiflac_expand_buffer(L, 1, lFlac, maxlen);
+    rd.used = 0;
+    do {
+        rd.data = luaminiflac_input_data(&in);
+        rd.len  = luaminiflac_input_len(&in);
 
-    r = f(&lFlac->flac,(const uint8_t*)str,(uint32_t)len,&used,lFlac->buffer,lFlac->buffer_len,&maxlen);
+        r = f(L,lFlac,&rd);
+        lua_settop(L,top);
+    } while(r == MINIFLAC_CONTINUE && luaminiflac_input_more(L,&in,&rd.used));
 
     switch(r) {
-        case MINIFLAC_METADATA_END: /* fall-through */
         case MINIFLAC_CONTINUE: {
             lua_pushboolean(L,0);
             lua_pushnil(L);
             break;
         }
         case MINIFLAC_OK: {
-            lua_pushlstring(L,(const char *)lFlac->buffer,maxlen);
+            lFlac->meta_step = 0;
+            lua_pushnil(L);
+            lua_setfield(L,-3,"meta");
             lua_pushnil(L);
             break;
         }
         default: {
+            lFlac->meta_step = 0;
             lua_pushnil(L);
-            lua_pushinteger(L,r);
+            luaminiflac_push_error(L,lFlac,r);
             break;
         }
     }
-    lua_pushlstring(L,&str[used],len-used);
+    luaminiflac_push_remain(L,&in,rd.used);
     return 3;
 }
 
+/* }}} */
+
 static const luaminiflac_metamethods_t luaminiflac_miniflac_metamethods[] = {
     { "miniflac_init",          "init"   },
+    { "miniflac_feed",          "feed"   },
     { "miniflac_sync",          "sync"   },
     { "miniflac_decode",        "decode" },
+    { "miniflac_decode_pcm",    "decode_pcm" },
+    { "miniflac_decode_into",   "decode_into" },
+    { "miniflac_decode_many",   "decode_many" },
 
     { "miniflac_streaminfo_min_block_size",    "streaminfo_min_block_size" },
     { "miniflac_streaminfo_max_block_size",    "streaminfo_max_block_size" },
@@ -1584,6 +6088,28 @@ static const luaminiflac_metamethods_t luaminiflac_miniflac_metamethods[] = {
     { "miniflac_padding_length",               "padding_length" },
     { "miniflac_padding_data",                 "padding_data" },
 
+    { "miniflac_read_streaminfo",              "read_streaminfo" },
+    { "miniflac_read_seektable",               "read_seektable" },
+    { "miniflac_read_vorbis_comment",          "read_vorbis_comment" },
+    { "miniflac_read_picture",                 "read_picture" },
+    { "miniflac_read_cuesheet",                "read_cuesheet" },
+    { "miniflac_read_application",             "read_application" },
+
+    { NULL, NULL },
+};
+
+/* methods that don't take input data, so miniflac.decoder
+ * doesn't wrap them */
+static const luaminiflac_metamethods_t luaminiflac_miniflac_methods[] = {
+    { "miniflac_enable_md5",    "enable_md5" },
+    { "miniflac_md5",           "md5"        },
+    { "miniflac_verify",        "verify"     },
+    { "miniflac_close",         "close"      },
+    { "miniflac_seek",          "seek"       },
+    { "miniflac_tell",          "tell"       },
+    { "miniflac_advise",        "advise"     },
+    { "miniflac_stats",         "stats"      },
+    { "miniflac_set_channels",  "set_channels" },
     { NULL, NULL },
 };
 
@@ -1651,6 +6177,15 @@ static const luaminiflac_closures_t luaminiflac_closures[] = {
     LMF(padding_length,uint32),
     LMF(padding_data,str),
 
+#define LMB(a) { (void*)luaminiflac_block_ ## a, luaminiflac_read_block, "miniflac_read_" #a }
+    LMB(streaminfo),
+    LMB(seektable),
+    LMB(vorbis_comment),
+    LMB(picture),
+    LMB(cuesheet),
+    LMB(application),
+#undef LMB
+
     { NULL, NULL, NULL },
 };
 
@@ -1659,9 +6194,41 @@ static const struct luaL_Reg luaminiflac_functions[] = {
     { "miniflac_int64_t",       luaminiflac_int64                  },
     { "miniflac_uint64_t",      luaminiflac_uint64                 },
     { "miniflac_t",             luaminiflac_miniflac_t             },
+    { "miniflac_metadata_t",    luaminiflac_miniflac_metadata_t    },
     { "miniflac_init",          luaminiflac_miniflac_init          },
+    { "miniflac_feed",          luaminiflac_miniflac_feed          },
     { "miniflac_sync",          luaminiflac_miniflac_sync          },
     { "miniflac_decode",        luaminiflac_miniflac_decode        },
+    { "miniflac_sync_at",       luaminiflac_miniflac_sync_at       },
+    { "miniflac_decode_at",     luaminiflac_miniflac_decode_at     },
+    { "miniflac_decode_pcm",    luaminiflac_miniflac_decode_pcm    },
+    { "miniflac_decode_pcm_at", luaminiflac_miniflac_decode_pcm_at },
+    { "miniflac_decode_into",   luaminiflac_miniflac_decode_into   },
+    { "miniflac_decode_into_at", luaminiflac_miniflac_decode_into_at },
+    { "miniflac_decode_many",   luaminiflac_miniflac_decode_many   },
+    { "miniflac_decode_many_at", luaminiflac_miniflac_decode_many_at },
+    { "miniflac_enable_md5",    luaminiflac_miniflac_enable_md5    },
+    { "miniflac_md5",           luaminiflac_miniflac_md5           },
+    { "miniflac_verify",        luaminiflac_miniflac_verify        },
+    { "miniflac_close",         luaminiflac_miniflac_close         },
+    { "open",                   luaminiflac_open                   },
+    { "from_fd",                luaminiflac_from_fd                },
+    { "mmap",                   luaminiflac_mmap                   },
+    { "miniflac_seek",          luaminiflac_miniflac_seek          },
+    { "miniflac_tell",          luaminiflac_miniflac_tell          },
+    { "miniflac_advise",        luaminiflac_miniflac_advise        },
+    { "miniflac_stats",         luaminiflac_miniflac_stats         },
+    { "miniflac_set_channels",  luaminiflac_miniflac_set_channels  },
+    { "samplebuf",              luaminiflac_samplebuf              },
+    { "frames",                 luaminiflac_frames                 },
+    { "find_frame",             luaminiflac_find_frame             },
+    { "skip_frame",             luaminiflac_skip_frame             },
+    { "scan_frames",            luaminiflac_scan_frames            },
+    { "ogg_page",               luaminiflac_ogg_page               },
+    { "index",                  luaminiflac_index                  },
+    { "index_load",             luaminiflac_index_load             },
+    { "decode_file_parallel",   luaminiflac_decode_file_parallel   },
+    { "async_decoder",          luaminiflac_async_decoder          },
     { NULL,                     NULL                               },
 };
 
@@ -1681,6 +6248,11 @@ int luaopen_miniflac(lua_State *L) {
     lua_setfield(L,-2,"_VERSION_PATCH");
     lua_pushliteral(L,LUAMINIFLAC_VERSION);
     lua_setfield(L,-2,"_VERSION");
+    lua_pushboolean(L,LUAMINIFLAC_NATIVE_INTEGERS);
+    lua_setfield(L,-2,"_NATIVE_INTEGERS");
+    luaminiflac_pack_init();
+    lua_pushstring(L,luaminiflac_simd);
+    lua_setfield(L,-2,"_SIMD");
 
     lua_newtable(L); /* MINIFLAC_STATE */
     luaminiflac_push_const(OGGHEADER);
@@ -1718,6 +6290,8 @@ int luaopen_miniflac(lua_State *L) {
     luaminiflac_push_const(CONTINUE);
     luaminiflac_push_const(OK);
     luaminiflac_push_const(METADATA_END);
+    lua_pushinteger(L,LUAMINIFLAC_SAMPLEBUF_TOO_SMALL);
+    lua_setfield(L,-2,"LUAMINIFLAC_SAMPLEBUF_TOO_SMALL");
     lua_setfield(L,-2,"MINIFLAC_RESULT");
 
     lua_newtable(L); /* MINIFLAC_METADATA_TYPE */
@@ -1763,6 +6337,8 @@ int luaopen_miniflac(lua_State *L) {
     luaminiflac_push_const(CONTINUE);
     luaminiflac_push_const(OK);
     luaminiflac_push_const(METADATA_END);
+    lua_pushinteger(L,LUAMINIFLAC_SAMPLEBUF_TOO_SMALL);
+    lua_setfield(L,-2,"LUAMINIFLAC_SAMPLEBUF_TOO_SMALL");
 
     luaminiflac_push_const(METADATA_UNKNOWN);
     luaminiflac_push_const(METADATA_STREAMINFO);
@@ -1778,19 +6354,44 @@ int luaopen_miniflac(lua_State *L) {
 
     while(miniflac_closures->f != NULL) {
         lua_pushlightuserdata(L,miniflac_closures->f);
-        lua_pushcclosure(L,miniflac_closures->l,1);
+        lua_pushboolean(L,0);
+        lua_pushcclosure(L,miniflac_closures->l,2);
         lua_setfield(L,-2,miniflac_closures->name);
+
+        /* offset-based variant, takes (data, pos) and returns the new pos */
+        lua_pushfstring(L,"%s_at",miniflac_closures->name);
+        lua_pushlightuserdata(L,miniflac_closures->f);
+        lua_pushboolean(L,1);
+        lua_pushcclosure(L,miniflac_closures->l,2);
+        lua_rawset(L,-3);
         miniflac_closures++;
     }
 
     luaL_newmetatable(L,luaminiflac_mt);
     lua_newtable(L); /* __index */
+    while(miniflac_mm->name != NULL) {
+        lua_getfield(L,-3,miniflac_mm->name);
+        lua_setfield(L,-2,miniflac_mm->metaname);
+
+        lua_pushfstring(L,"%s_at",miniflac_mm->metaname);
+        lua_pushfstring(L,"%s_at",miniflac_mm->name);
+        lua_rawget(L,-5);
+        if(lua_isnil(L,-1)) {
+            lua_pop(L,2);
+        } else {
+            lua_rawset(L,-3);
+        }
+        miniflac_mm++;
+    }
+    miniflac_mm = luaminiflac_miniflac_methods;
     while(miniflac_mm->name != NULL) {
         lua_getfield(L,-3,miniflac_mm->name);
         lua_setfield(L,-2,miniflac_mm->metaname);
         miniflac_mm++;
     }
     lua_setfield(L,-2,"__index");
+    lua_getfield(L,-2,"miniflac_close");
+    lua_setfield(L,-2,"__gc");
     lua_pop(L,1);
 
     lua_newtable(L); /* our _metamethods table */
@@ -1808,6 +6409,31 @@ int luaopen_miniflac(lua_State *L) {
     lua_getfield(L,-1,"miniflac_uint64_t");
     lua_setfield(L,-2,"uint64_t");
 
+    luaL_newmetatable(L,luaminiflac_samplebuf_mt);
+    lua_newtable(L); /* methods, upvalue for __index */
+    luaL_setfuncs(L,luaminiflac_samplebuf_methods,0);
+    lua_pushcclosure(L,luaminiflac_samplebuf__index,1);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,luaminiflac_samplebuf__len);
+    lua_setfield(L,-2,"__len");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaminiflac_index_mt);
+    lua_newtable(L);
+    luaL_setfuncs(L,luaminiflac_index_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,luaminiflac_index__len);
+    lua_setfield(L,-2,"__len");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaminiflac_async_mt);
+    lua_newtable(L);
+    luaL_setfuncs(L,luaminiflac_async_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pushcfunction(L,luaminiflac_async_close);
+    lua_setfield(L,-2,"__gc");
+    lua_pop(L,1);
+
     luaL_newmetatable(L,luaminiflac_int64_mt);
     luaL_setfuncs(L,luaminiflac_int64_metamethods,0);
     lua_pop(L,1);
@@ -0,0 +1,116 @@
+-- LuaJIT FFI bindings for the decoder core
+--
+-- calls go straight into the C functions exported by the miniflac
+-- module, and samples are read as int32_t* without building tables,
+-- so a decode loop written against this can be compiled by the JIT.
+-- only sync and decode are covered, use the regular module to read
+-- metadata blocks.
+
+local ffi = require'ffi'
+local miniflac = require'miniflac'
+
+local cast = ffi.cast
+local gc = ffi.gc
+local tonumber = tonumber
+local type = type
+local error = error
+
+ffi.cdef[[
+typedef struct luaminiflac_ffi_frame_s {
+  uint64_t sample_number;
+  uint32_t frame_number;
+  uint32_t block_size;
+  uint32_t sample_rate;
+  uint8_t channels;
+  uint8_t bps;
+  uint8_t blocking_strategy;
+  uint8_t channel_assignment;
+} luaminiflac_ffi_frame_t;
+
+typedef struct luaminiflac_ffi_s {
+  int32_t* samples[8];
+  luaminiflac_ffi_frame_t frame;
+  int32_t state;
+  int32_t metadata_type;
+  uint32_t metadata_length;
+  int32_t metadata_is_last;
+} luaminiflac_ffi_t;
+
+luaminiflac_ffi_t* luaminiflac_ffi_new(int container);
+void luaminiflac_ffi_free(luaminiflac_ffi_t* dec);
+int luaminiflac_ffi_reset(luaminiflac_ffi_t* dec, int container);
+int luaminiflac_ffi_sync(luaminiflac_ffi_t* dec, const uint8_t* data, uint32_t len, uint32_t* used);
+int luaminiflac_ffi_decode(luaminiflac_ffi_t* dec, const uint8_t* data, uint32_t len, uint32_t* used);
+]]
+
+-- the symbols are in the miniflac module itself, which Lua
+-- loaded privately, so open the same file again by path
+local path = package.searchpath('miniflac',package.cpath)
+if not path then
+  error('miniflac.ffi: unable to find the miniflac module in package.cpath')
+end
+local C = ffi.load(path)
+
+local used = ffi.new('uint32_t[1]')
+
+-- strings are bounds checked, pointers are trusted
+local function input(data,offset,len)
+  offset = offset or 0
+  if type(data) == 'string' then
+    if offset < 0 or offset > #data then
+      error('offset out of range',3)
+    end
+    len = len or #data - offset
+    if len < 0 or offset + len > #data then
+      error('len out of range',3)
+    end
+  elseif not len then
+    error('len is required when data is a pointer',3)
+  end
+  return cast('const uint8_t*',data) + offset, len
+end
+
+local FFI = {
+  OK = miniflac.MINIFLAC_OK,
+  CONTINUE = miniflac.MINIFLAC_CONTINUE,
+  ERROR = miniflac.MINIFLAC_ERROR,
+}
+
+local Decoder = {}
+
+-- dec:sync(data [, offset [, len]]) returns result, bytes used.
+-- data is a string or a pointer (len is required for pointers),
+-- offset is 0-based, and offset and len must stay within a string.
+-- on FFI.OK dec.state tells what was found
+function Decoder:sync(data,offset,len)
+  local p, n = input(data,offset,len)
+  local r = C.luaminiflac_ffi_sync(self,p,n,used)
+  return r, tonumber(used[0])
+end
+
+-- dec:decode(data [, offset [, len]]) returns result, bytes used.
+-- on FFI.OK the frame is in dec.samples[channel][i], both 0-based,
+-- and dec.frame has the header
+function Decoder:decode(data,offset,len)
+  local p, n = input(data,offset,len)
+  local r = C.luaminiflac_ffi_decode(self,p,n,used)
+  return r, tonumber(used[0])
+end
+
+function Decoder:reset(container)
+  if C.luaminiflac_ffi_reset(self,container or miniflac.MINIFLAC_CONTAINER_UNKNOWN) ~= 0 then
+    error('invalid container type')
+  end
+end
+
+ffi.metatype('luaminiflac_ffi_t',{ __index = Decoder })
+
+function FFI.new(container)
+  local dec = C.luaminiflac_ffi_new(container or miniflac.MINIFLAC_CONTAINER_UNKNOWN)
+  if dec == nil then
+    error('invalid container type or out of memory')
+  end
+  return gc(dec,C.luaminiflac_ffi_free)
+end
+
+return FFI
@@ -0,0 +1,587 @@
+-- sample-accurate seeking for native FLAC streams
+--
+-- frames are located with miniflac.find_frame. the SEEKTABLE is used
+-- to get close to the target when present, otherwise we bisect on
+-- byte offsets. from there we walk frame headers until we reach the
+-- frame holding the target sample, and decode it.
+--
+-- with a frame index (see build_index) we jump straight to the frame.
+--
+-- Ogg FLAC streams are bisected on page granule positions instead, and
+-- the FLAC frames are unwrapped from the pages before decoding.
+
+local miniflac = require'miniflac'
+local decoder = require'miniflac.decoder'
+
+local type = type
+local tonumber = tonumber
+local tostring = tostring
+local ipairs = ipairs
+local setmetatable = setmetatable
+local floor = math.floor
+local min = math.min
+local max = math.max
+local byte = string.byte
+local char = string.char
+local open = io.open
+local find_frame = miniflac.find_frame
+local skip_frame = miniflac.skip_frame
+local ogg_page = miniflac.ogg_page
+
+local NATIVE = miniflac.MINIFLAC_CONTAINER_NATIVE
+local OGG = miniflac.MINIFLAC_CONTAINER_OGG
+local WINDOW = 65536
+
+-- seek offsets and sample numbers may be uint64_t userdata
+local function to_number(v)
+  if type(v) == 'number' then return v end
+  return tonumber(tostring(v))
+end
+
+local function file_reader(f)
+  return function(offset,length)
+    f:seek('set',offset)
+    return f:read(length)
+  end
+end
+
+-- the offset of the "fLaC" or "OggS" marker, after any ID3v2 tags
+local function stream_start(reader)
+  local offset = 0
+  local h = reader(0,10)
+  local flags, s1, s2, s3, s4
+
+  while h and #h == 10 and h:sub(1,3) == 'ID3' do
+    flags, s1, s2, s3, s4 = byte(h,6,10)
+    -- the size is 28 bits, 7 to a byte, and leaves out the 10 byte
+    -- header and footer
+    offset = offset + 10 + s1 * 2097152 + s2 * 16384 + s3 * 128 + s4
+    if flags % 32 >= 16 then offset = offset + 10 end
+    h = reader(offset,10)
+  end
+  return offset
+end
+
+local Seekable = {}
+Seekable.__index = Seekable
+
+-- src is a filename, a file handle, or a function(offset,length)
+-- that returns length bytes starting at the 0-based offset. with
+-- a function, the total size of the stream must be given
+function Seekable.new(src,size)
+  local self = setmetatable({
+    file = nil,
+    reader = nil,
+    size = size,
+    metadata = nil,
+    streaminfo = nil,
+    seekpoints = nil,
+    index = nil,
+    start = 0, -- offset of the stream marker
+    audio_offset = 0,
+    header = nil, -- marker and STREAMINFO block, fed to the decoder after a seek
+    decoder = miniflac.miniflac_t(NATIVE),
+    pos = 0, -- offset of the next byte (or Ogg page) to feed to the decoder
+    started = false, -- the decoder has been primed with the header
+    buf = nil, -- window of data for finding frames
+    buf_offset = 0,
+    ogg = false,
+    serial = nil, -- serial number of the Ogg FLAC stream
+    skip = 0, -- bytes to drop from the next Ogg page
+  },Seekable)
+  local offset, marker, err
+
+  if type(src) == 'string' then
+    self.file, err = open(src,'rb')
+    if not self.file then return nil, err end
+    src = self.file
+  end
+
+  if type(src) == 'function' then
+    self.reader = src
+  else
+    self.reader = file_reader(src)
+    if not self.size then
+      self.size = src:seek('end')
+    end
+  end
+
+  if not self.size then
+    self:close()
+    return nil, 'size is required when using a reader function'
+  end
+
+  self.start = stream_start(self.reader)
+  marker = self.reader(self.start,4)
+  self.ogg = marker == 'OggS'
+  if marker ~= 'fLaC' and not self.ogg then
+    self:close()
+    return nil, 'not a FLAC stream'
+  end
+
+  offset = self.start
+  self.metadata = decoder.scan_metadata(function(n)
+    local data = self.reader(offset,n)
+    if data then offset = offset + #data end
+    return data
+  end,self.ogg and OGG or NATIVE)
+
+  self.audio_offset = self.start + 4
+  for _,b in ipairs(self.metadata) do
+    self.audio_offset = self.audio_offset + 4 + b.metadata.length
+    if b.metadata.type == 'streaminfo' then
+      self.streaminfo = b.metadata.streaminfo
+    elseif b.metadata.type == 'seektable' and not self.ogg then
+      -- seekpoint offsets don't account for Ogg pages
+      self.seekpoints = b.metadata.seektable.seekpoints
+    end
+  end
+
+  if not self.streaminfo then
+    self:close()
+    return nil, 'missing STREAMINFO'
+  end
+
+  if self.ogg then
+    self.audio_offset = self:ogg_audio_offset()
+    if not self.audio_offset then
+      self:close()
+      return nil, 'no Ogg FLAC audio pages found'
+    end
+  else
+    self:set_header(self.reader(self.start + 8,34))
+  end
+
+  return self
+end
+
+-- keeps the STREAMINFO block, marked as the last metadata block, to
+-- feed the decoder after a seek. frames can leave the sample rate and
+-- bps to STREAMINFO, so the decoder has to see it before them
+function Seekable:set_header(streaminfo)
+  self.header = 'fLaC' .. char(0x80,0,0,34) .. streaminfo
+end
+
+function Seekable:close()
+  if self.file then
+    self.file:close()
+    self.file = nil
+  end
+end
+
+-- the number of the first sample in a frame
+function Seekable:frame_sample(header)
+  if header.blocking_strategy == 1 then
+    return to_number(header.sample_number)
+  end
+  return header.frame_number * self.streaminfo.max_block_size
+end
+
+-- rejects headers that don't match the stream
+function Seekable:valid_header(header)
+  local streaminfo = self.streaminfo
+  return header.channels == streaminfo.channels
+    and header.block_size <= streaminfo.max_block_size
+    and (header.bps == 0 or header.bps == streaminfo.bps)
+    and (header.sample_rate == 0 or header.sample_rate == streaminfo.sample_rate)
+end
+
+-- finds the first frame at or after a byte offset,
+-- returns the offset and frame header
+function Seekable:next_frame(offset)
+  local found, header, buf_end
+
+  while offset < self.size do
+    buf_end = self.buf and self.buf_offset + #self.buf
+    if not self.buf
+      or offset < self.buf_offset
+      or (offset + 32 > buf_end and buf_end < self.size) then
+      self.buf = self.reader(offset,WINDOW)
+      self.buf_offset = offset
+      if not self.buf or #self.buf == 0 then
+        self.buf = nil
+        return nil
+      end
+    end
+
+    found, header = find_frame(self.buf,offset - self.buf_offset + 1)
+    if found then
+      offset = self.buf_offset + found - 1
+      if self:valid_header(header) then
+        return offset, header
+      end
+      offset = offset + 1
+    else
+      -- header is the position to resume searching from
+      if self.buf_offset + #self.buf >= self.size then
+        return nil
+      end
+      offset = self.buf_offset + header - 1
+      self.buf = nil
+    end
+  end
+
+  return nil
+end
+
+-- finds the frame after the one at offset, a sync code inside of
+-- the frame's audio data won't have the right sample number. the
+-- search stops after max_frame_size bytes when STREAMINFO has it
+function Seekable:following_frame(offset,header)
+  local expected = self:frame_sample(header) + header.block_size
+  local min_size = self.streaminfo.min_frame_size
+  local max_size = self.streaminfo.max_frame_size
+  local limit = max_size > 0 and offset + max_size or self.size
+  local h
+
+  offset = offset + (min_size > header.header_size and min_size or header.header_size)
+  while true do
+    offset, h = self:next_frame(offset)
+    if not offset or offset > limit then return nil end
+    if self:frame_sample(h) == expected then
+      return offset, h
+    end
+    offset = offset + 1
+  end
+end
+
+-- checks the CRC-16 of the frame at offset
+function Seekable:frame_ok(offset)
+  local max_size = self.streaminfo.max_frame_size
+  local data = self.reader(offset,max_size > 0 and max_size + 16 or WINDOW * 16)
+  return data ~= nil and skip_frame(data,1,offset + #data >= self.size) == 1
+end
+
+-- like following_frame, but when the next frame is damaged, picks
+-- up at the first good frame after it
+function Seekable:next_good_frame(offset,header)
+  local sample = self:frame_sample(header)
+  local o, h = self:following_frame(offset,header)
+
+  if o then return o, h end
+  o = offset + header.header_size
+  while true do
+    o, h = self:next_frame(o)
+    if not o then return nil end
+    if self:frame_sample(h) > sample and self:frame_ok(o) then
+      return o, h
+    end
+    o = o + 1
+  end
+end
+
+-- finds the first page of the FLAC stream at or after a byte offset,
+-- returns the offset and page. the whole page is in self.buf
+function Seekable:next_page(offset)
+  local found, page, buf_end
+
+  while offset < self.size do
+    buf_end = self.buf and self.buf_offset + #self.buf
+    if not self.buf or offset < self.buf_offset or offset >= buf_end then
+      self.buf = self.reader(offset,WINDOW)
+      self.buf_offset = offset
+      if not self.buf or #self.buf == 0 then
+        self.buf = nil
+        return nil
+      end
+      buf_end = offset + #self.buf
+    end
+
+    found, page = ogg_page(self.buf,offset - self.buf_offset + 1)
+    if found then
+      offset = self.buf_offset + found - 1
+      if self.serial == nil or page.serial == self.serial then
+        return offset, page
+      end
+      offset = offset + page.size
+    else
+      -- a page is never bigger than the window, so a fresh
+      -- window at the resume position will hold all of it
+      if buf_end >= self.size then
+        return nil
+      end
+      offset = self.buf_offset + page - 1
+      self.buf = nil
+    end
+  end
+
+  return nil
+end
+
+-- the header of the first frame that begins on a page, if any
+function Seekable:page_frame(offset,page)
+  local body = offset - self.buf_offset + page.header_size
+  local found, header
+
+  if page.first_packet >= page.body_size then return nil end
+  found, header = find_frame(self.buf:sub(body + page.first_packet + 1,body + page.body_size),1)
+  if found == 1 and self:valid_header(header) then
+    return header
+  end
+  -- no frame, or the header continues on the next page
+  return nil
+end
+
+-- finds the FLAC stream's serial number, and returns the
+-- offset of its first audio page
+function Seekable:ogg_audio_offset()
+  local offset, page = self:next_page(0)
+  local body, b1, b2
+
+  while offset and page.bos do
+    body = offset - self.buf_offset + page.header_size
+    if self.buf:sub(body + 1,body + 5) == '\127FLAC' then
+      self.serial = page.serial
+      -- the packet is "\127FLAC", a version, a header count, "fLaC"
+      -- and the STREAMINFO block
+      self:set_header(self.buf:sub(body + 18,body + 51))
+      break
+    end
+    offset, page = self:next_page(offset + page.size)
+  end
+  if not self.serial then return nil end
+
+  -- audio packets start on a fresh page, and begin with a frame
+  -- sync code, which no metadata block header can look like
+  while offset do
+    if page.first_packet == 0 and page.body_size >= 2 then
+      body = offset - self.buf_offset + page.header_size
+      b1, b2 = byte(self.buf,body + 1,body + 2)
+      if b1 == 0xFF and (b2 == 0xF8 or b2 == 0xF9) then
+        return offset
+      end
+    end
+    offset, page = self:next_page(offset + page.size)
+  end
+
+  return nil
+end
+
+-- finds a page where a frame at or before the target sample begins.
+-- returns the offset of the page, the page, and the frame's first sample
+function Seekable:locate_ogg(target)
+  local lo = self.audio_offset
+  local hi = self.size
+  local offset, page, mid, header, sample
+  local best, best_page, best_sample
+
+  -- granule positions are the sample count at the end of the last
+  -- packet finished on a page, pages without one are skipped
+  while hi - lo > WINDOW do
+    mid = floor((lo + hi) / 2)
+    offset, page = self:next_page(mid)
+    while offset and offset < hi and not page.granule do
+      offset, page = self:next_page(offset + page.size)
+    end
+    if not offset or offset >= hi then
+      hi = mid
+    elseif to_number(page.granule) <= target then
+      lo = offset
+    else
+      hi = mid
+    end
+  end
+
+  offset, page = self:next_page(lo)
+  while offset do
+    header = self:page_frame(offset,page)
+    if header then
+      sample = self:frame_sample(header)
+      if sample > target then break end
+      best, best_page, best_sample = offset, page, sample
+    end
+    if best and page.granule and to_number(page.granule) > target then
+      break
+    end
+    offset, page = self:next_page(offset + page.size)
+  end
+
+  return best, best_page, best_sample
+end
+
+-- finds the frame holding the target sample, returns the
+-- byte offset of the frame, its header, and its first sample
+function Seekable:locate(target)
+  local lo = self.audio_offset
+  local hi = self.size
+  local window = self.streaminfo.max_frame_size
+  local offset, header, sample, mid
+
+  if self.seekpoints then
+    -- placeholder points have the largest possible sample number, so
+    -- they're skipped along with points past the target
+    for _,point in ipairs(self.seekpoints) do
+      if to_number(point.sample_number) > target then break end
+      lo = self.audio_offset + to_number(point.sample_offset)
+    end
+  else
+    if window == 0 then window = WINDOW end
+    while hi - lo > window do
+      mid = floor((lo + hi) / 2)
+      offset, header = self:next_frame(mid)
+      if not offset or offset >= hi then
+        hi = mid
+      elseif self:frame_sample(header) <= target then
+        lo = offset
+      else
+        hi = mid
+      end
+    end
+  end
+
+  offset, header = self:next_frame(lo)
+  while offset do
+    sample = self:frame_sample(header)
+    if target < sample + header.block_size then
+      return offset, header, sample
+    end
+    offset, header = self:next_good_frame(offset,header)
+  end
+
+  return nil
+end
+
+-- records the offset of every frame, and uses it for later seeks.
+-- damaged frames are left out, see next_good_frame.
+-- the index can be cached with index:serialize(), and restored
+-- with miniflac.index_load()
+--
+-- for Ogg streams, there's an entry for each page where a frame
+-- begins, covering the samples up to the next entry
+function Seekable:build_index()
+  local index = miniflac.index()
+  local offset, header, page, sample, granule
+  local last, last_sample
+
+  if self.ogg then
+    offset, page = self:next_page(self.audio_offset)
+    while offset do
+      header = self:page_frame(offset,page)
+      if header then
+        sample = self:frame_sample(header)
+        if last then
+          index:add(last,last_sample,min(sample - last_sample,65536))
+        end
+        last, last_sample = offset, sample
+      end
+      granule = page.granule or granule
+      offset, page = self:next_page(offset + page.size)
+    end
+    if last then
+      granule = granule and to_number(granule) or 0
+      index:add(last,last_sample,min(max(granule - last_sample,1),65536))
+    end
+    self.index = index
+    return index
+  end
+
+  offset, header = self:next_frame(self.audio_offset)
+  while offset do
+    index:add(offset,self:frame_sample(header),header.block_size)
+    offset, header = self:next_good_frame(offset,header)
+  end
+
+  self.index = index
+  return index
+end
+
+-- primes a fresh decoder with the header, ready to
+-- decode the frame (or Ogg page) at offset
+function Seekable:restart(offset)
+  -- init also drops whatever was fed from the old position
+  self.decoder:init(NATIVE)
+  self.decoder:feed(self.header)
+  self.pos = offset
+  self.skip = 0
+  self.started = true
+end
+
+-- decodes the frame holding the target sample, returns the frame
+-- (in the same format as miniflac_t:decode) and the offset of
+-- the target sample within the frame. frames after it can be
+-- decoded with :read(). index defaults to the one from build_index
+function Seekable:seek(target,index)
+  local offset, sample, page, frame, header, err, _
+
+  target = to_number(target)
+  index = index or self.index
+  if index then
+    offset, sample = index:find(target)
+    if offset then
+      offset, sample = to_number(offset), to_number(sample)
+    end
+  end
+  -- an index can have gaps where frames were damaged, so
+  -- look for anything it doesn't have
+  if not offset then
+    if self.ogg then
+      offset, page, sample = self:locate_ogg(target)
+    else
+      offset, _, sample = self:locate(target)
+    end
+  end
+  if not offset then return nil, 'sample out of range' end
+
+  self:restart(offset)
+  if self.ogg then
+    if not page then _, page = self:next_page(offset) end
+    self.skip = page.first_packet
+  end
+
+  -- in Ogg streams we may start a few frames early
+  repeat
+    frame, err = self:read()
+    if not frame then return nil, err or 'sample out of range' end
+    header = frame.frame.header
+    sample = self:frame_sample(header)
+  until target < sample + header.block_size
+  if target < sample then return nil, 'sample is in a damaged frame' end
+
+  return frame, target - sample
+end
+
+-- returns the FLAC data from the next page of the stream,
+-- nil at the end of the stream
+function Seekable:read_page()
+  local offset, page = self:next_page(self.pos)
+  local body, skip
+
+  if not offset then return nil end
+  self.pos = offset + page.size
+  body = offset - self.buf_offset + page.header_size
+  skip, self.skip = self.skip, 0
+  return self.buf:sub(body + skip + 1,body + page.body_size)
+end
+
+-- decodes the next frame, returns nil at the end of the stream.
+-- without a seek first, starts at the first frame
+function Seekable:read()
+  local frame, err, data
+
+  -- the metadata (and Ogg mapping packets) never go to the
+  -- decoder, it gets the header like after a seek
+  if not self.started then
+    self:restart(self.audio_offset)
+  end
+
+  repeat
+    frame, err = self.decoder:decode()
+    if err then return nil, err end
+    if not frame then
+      if self.ogg then
+        repeat
+          data = self:read_page()
+        until not data or #data > 0
+      else
+        data = self.reader(self.pos,WINDOW)
+        if data then self.pos = self.pos + #data end
+      end
+      if not data or #data == 0 then return nil end
+      self.decoder:feed(data)
+    end
+  until frame
+
+  return frame
+end
+
+return Seekable
@@ -0,0 +1,187 @@
+-- decoding tests for the miniflac bindings
+--
+-- usage: lua test/decode.lua fixture.flac
+--
+-- the fixture is a file written by bench/gen_fixture. run it with the
+-- module paths set, `make test` does this for you.
+
+local miniflac = require'miniflac'
+
+local format = string.format
+local ipairs = ipairs
+local tostring = tostring
+
+local NATIVE = miniflac.MINIFLAC_CONTAINER_NATIVE
+
+local function check(err,what)
+  if err then error(format('%s: %s',what,tostring(err)),2) end
+end
+
+local function expect(a,b,what)
+  if a ~= b then
+    error(format('%s: expected %s, got %s',what,tostring(b),tostring(a)),2)
+  end
+end
+
+-- each test takes the file contents
+
+local tests = {}
+
+tests[#tests+1] = { 'stats_byte_at_a_time', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local frames, result, err, rem = 0
+  local st
+
+  -- frame headers are split over calls at every byte,
+  -- which isn't a loss of sync
+  for i=1,#data do
+    rem = data:sub(i,i)
+    repeat
+      result, err, rem = dec:decode(rem)
+      check(err,'decode')
+      if result then frames = frames + 1 end
+    until #rem == 0
+  end
+
+  st = dec:stats()
+  assert(frames > 0,'no frames decoded')
+  expect(st.frames,frames,'frames')
+  expect(st.resyncs,0,'resyncs')
+  expect(st.skipped_bytes,0,'skipped_bytes')
+end }
+
+-- decodes every frame, using :decode() alone
+local function decode_all(dec,data)
+  local result, err = nil, nil
+  repeat
+    result, err, data = dec:decode(data)
+    check(err,'decode')
+  until not result
+end
+
+-- the STREAMINFO md5 is bytes 27 to 42
+local function set_md5(data,md5)
+  return data:sub(1,26) .. md5 .. data:sub(43)
+end
+
+tests[#tests+1] = { 'verify_with_decode', function(data)
+  local dec = miniflac.miniflac_t(NATIVE)
+  local match, md5, expected, _
+
+  -- the generated file has no md5
+  dec:enable_md5()
+  decode_all(dec,data)
+  match, md5, expected = dec:verify()
+  expect(match,nil,'match without an md5')
+  expect(#md5,16,'md5 length')
+
+  dec = miniflac.miniflac_t(NATIVE)
+  dec:enable_md5()
+  decode_all(dec,set_md5(data,md5))
+  match, _, expected = dec:verify()
+  expect(match,true,'match')
+  expect(expected,md5,'expected md5')
+
+  dec = miniflac.miniflac_t(NATIVE)
+  dec:enable_md5()
+  decode_all(dec,set_md5(data,md5:reverse()))
+  match = dec:verify()
+  expect(match,false,'match with the wrong md5')
+end }
+
+-- decodes data on a worker thread, returns how many
+-- frames came back and the error try_pop ended with
+local function decode_async(data)
+  local dec = miniflac.async_decoder(NATIVE)
+  local frames, pos, frame, err = 0, 1
+
+  while pos <= #data do
+    pos = pos + dec:feed(data:sub(pos))
+    frame = dec:try_pop()
+    if frame then frames = frames + 1 end
+  end
+  dec:finish()
+
+  repeat
+    frame, err = dec:try_pop()
+    if frame then frames = frames + 1 end
+  until frame == nil
+  dec:close()
+  return frames, err
+end
+
+tests[#tests+1] = { 'async_truncated', function(data)
+  local frames, err = decode_async(data)
+  expect(err,nil,'error at the end of the stream')
+  assert(frames > 1,'not enough frames decoded')
+
+  -- cutting into the last frame drops it, and says so
+  local truncated, terr = decode_async(data:sub(1,#data - 10))
+  expect(truncated,frames - 1,'frames from a truncated stream')
+  expect(terr,miniflac.MINIFLAC_CONTINUE,'error from a truncated stream')
+end }
+
+tests[#tests+1] = { 'frames_truncated', function(data)
+  -- a reader handing out the data in small chunks
+  local function reader(s)
+    local pos = 1
+    return function(n)
+      if pos > #s then return nil end
+      local chunk = s:sub(pos,pos + 999)
+      pos = pos + #chunk
+      return chunk
+    end
+  end
+  local frames, truncated = 0, 0
+  local ok, err
+
+  for _ in miniflac.frames(reader(data)) do frames = frames + 1 end
+  assert(frames > 1,'not enough frames decoded')
+
+  ok, err = pcall(function()
+    for _ in miniflac.frames(reader(data:sub(1,#data - 10))) do
+      truncated = truncated + 1
+    end
+  end)
+  expect(ok,false,'iterating a truncated stream')
+  assert(tostring(err):find('truncated frame',1,true),tostring(err))
+  expect(truncated,frames - 1,'frames from a truncated stream')
+end }
+
+tests[#tests+1] = { 'scan_frames_trailing_junk', function(data)
+  local pos = assert(miniflac.find_frame(data,1))
+  local frames, _, err = miniflac.scan_frames(data,pos,true)
+  local tag = 'TAG' .. ('\0'):rep(125)
+  local tagged, terr
+
+  check(err,'scan_frames')
+  tagged, _, terr = miniflac.scan_frames(data .. tag,pos,true)
+  check(terr,'scan_frames with a tag')
+  expect(#tagged,#frames,'frames with a tag')
+  expect(tagged[#tagged].size,frames[#frames].size,'size of the last frame')
+end }
+
+local path = arg[1]
+local failed = 0
+local f, data
+
+if not path then
+  io.stderr:write('usage: lua test/decode.lua fixture.flac\n')
+  os.exit(1)
+end
+
+f = assert(io.open(path,'rb'))
+data = f:read('*a')
+f:close()
+
+for _,t in ipairs(tests) do
+  local ok, err = pcall(t[2],data)
+  if ok then
+    print('ok ' .. t[1])
+  else
+    failed = failed + 1
+    print('not ok ' .. t[1] .. ': ' .. tostring(err))
+  end
+end
+
+os.exit(failed == 0 and 0 or 1)
@@ -0,0 +1,111 @@
+/* checks every PCM packing kernel against the scalar code
+ *
+ * usage: pack_pcm
+ *
+ * each kernel set that was built and runs on this CPU is selected in
+ * turn, and every format is packed for 1 to 3 channels, bps 1 to 32 and
+ * block sizes around the vector widths, from in-range samples, full
+ * 32-bit noise and the int32_t extremes. the output, and the bytes after
+ * it, have to match the scalar code exactly. exits non-zero on the first
+ * set with a mismatch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../csrc/luaminiflac_pcm.h"
+
+#define MAX_BLOCK 67
+#define MAX_CHANNELS 3
+#define SLACK 64
+
+static const char* const formats[] = { "s16", "s24", "s32", "f32" };
+
+static uint32_t seed = 12345;
+
+static uint32_t
+rnd(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* kind 0 is in range for bps, 1 is any 32-bit value, 2 is the extremes */
+static void
+fill(int32_t** samples, unsigned int kind, uint8_t bps) {
+    unsigned int c = 0;
+    unsigned int i = 0;
+    int32_t v = 0;
+
+    for(c=0;c<MAX_CHANNELS;c++) {
+        for(i=0;i<MAX_BLOCK;i++) {
+            v = (int32_t)rnd();
+            if(kind == 0 && bps < 32) v >>= 32 - bps;
+            if(kind == 2) v = rnd() & 1 ? INT32_MIN : INT32_MAX;
+            samples[c][i] = v;
+        }
+    }
+}
+
+static unsigned long
+check(LUAMINIFLAC_SIMD set, unsigned long* cases) {
+    static int32_t data[MAX_CHANNELS][MAX_BLOCK];
+    static uint8_t got[MAX_BLOCK * MAX_CHANNELS * 4 + SLACK];
+    static uint8_t want[MAX_BLOCK * MAX_CHANNELS * 4 + SLACK];
+    int32_t* samples[8];
+    unsigned long failed = 0;
+    unsigned int format = 0;
+    unsigned int kind = 0;
+    uint8_t channels = 0;
+    uint8_t bps = 0;
+    uint32_t len = 0;
+
+    for(channels=0;channels<MAX_CHANNELS;channels++) samples[channels] = data[channels];
+
+    for(format=0;format<4;format++) {
+        for(channels=1;channels<=MAX_CHANNELS;channels++) {
+            for(bps=1;bps<=32;bps++) {
+                for(kind=0;kind<3;kind++) {
+                    fill(samples,kind,bps);
+                    for(len=0;len<=MAX_BLOCK;len++) {
+                        memset(got,0xA5,sizeof(got));
+                        memset(want,0xA5,sizeof(want));
+                        luaminiflac_pack_pcm(got,samples,channels,len,bps,(LUAMINIFLAC_PCM)format);
+                        luaminiflac_pack_pcm_scalar(want,samples,channels,0,len,bps,(LUAMINIFLAC_PCM)format);
+                        (*cases)++;
+                        if(memcmp(got,want,sizeof(got)) != 0) {
+                            if(failed++ < 10) {
+                                fprintf(stderr,"%s: mismatch for %s, %u channels, %u bps, %u samples, kind %u\n",
+                                  luaminiflac_simd_names[set],formats[format],
+                                  (unsigned int)channels,(unsigned int)bps,(unsigned int)len,kind);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+int main(void) {
+    unsigned int set = 0;
+    unsigned long cases = 0;
+    unsigned long failed = 0;
+    int ret = 0;
+
+    for(set=0;luaminiflac_simd_names[set] != NULL;set++) {
+        if(!luaminiflac_pack_select((LUAMINIFLAC_SIMD)set)) {
+            printf("%s: not available, skipped\n",luaminiflac_simd_names[set]);
+            continue;
+        }
+        cases = 0;
+        failed = check((LUAMINIFLAC_SIMD)set,&cases);
+        printf("%s: %lu cases, %lu mismatches\n",luaminiflac_simd_names[set],cases,failed);
+        if(failed) ret = 1;
+    }
+
+    luaminiflac_pack_init();
+    printf("default: %s\n",luaminiflac_simd);
+    return ret;
+}